@@ -122,6 +122,16 @@ typedef struct amqp_table_t_ {
 
 #define AMQP_EMPTY_TABLE ((amqp_table_t) { .num_entries = 0, .entries = NULL })
 
+/*
+ * A table decoded into a pool flagged AMQP_POOL_LAZY_TABLES is left
+ * encoded: its num_entries is AMQP_TABLE_LAZY and its entries point
+ * at the table's encoding in the received frame, which lives as long
+ * as the rest of the decoded frame does. Look keys up with
+ * amqp_table_find(), or decode the lot with amqp_table_materialize().
+ * Lazy tables are sent on as they are by the encoder.
+ */
+#define AMQP_TABLE_LAZY (-1)
+
 typedef struct amqp_array_t_ {
   int num_entries;
   struct amqp_field_value_t_ *entries;
@@ -129,6 +139,14 @@ typedef struct amqp_array_t_ {
 
 #define AMQP_EMPTY_ARRAY ((amqp_array_t) { .num_entries = 0, .entries = NULL })
 
+/*
+ * A table encoded once, up front, for reuse; see
+ * amqp_encoded_table_init().
+ */
+typedef struct amqp_encoded_table_t_ {
+  amqp_bytes_t bytes; /* the table's wire form, size prefix included */
+} amqp_encoded_table_t;
+
 /*
   0-9   0-9-1   Qpid/Rabbit  Type               Remarks
 ---------------------------------------------------------------------------
@@ -168,25 +186,27 @@ of the other two, so this will work for both 0-8 and 0-9-1 branches of
 the code.
 */
 
+typedef union amqp_field_value_union_t_ {
+  amqp_boolean_t boolean;
+  int8_t i8;
+  uint8_t u8;
+  int16_t i16;
+  uint16_t u16;
+  int32_t i32;
+  uint32_t u32;
+  int64_t i64;
+  uint64_t u64;
+  float f32;
+  double f64;
+  amqp_decimal_t decimal;
+  amqp_bytes_t bytes;
+  amqp_table_t table;
+  amqp_array_t array;
+} amqp_field_value_union_t;
+
 typedef struct amqp_field_value_t_ {
   char kind;
-  union {
-    amqp_boolean_t boolean;
-    int8_t i8;
-    uint8_t u8;
-    int16_t i16;
-    uint16_t u16;
-    int32_t i32;
-    uint32_t u32;
-    int64_t i64;
-    uint64_t u64;
-    float f32;
-    double f64;
-    amqp_decimal_t decimal;
-    amqp_bytes_t bytes;
-    amqp_table_t table;
-    amqp_array_t array;
-  } value;
+  amqp_field_value_union_t value;
 } amqp_field_value_t;
 
 typedef struct amqp_table_entry_t_ {
@@ -194,6 +214,21 @@ typedef struct amqp_table_entry_t_ {
   amqp_field_value_t value;
 } amqp_table_entry_t;
 
+/*
+ * A table laid out as parallel arrays instead of an array of entries,
+ * so that scanning its keys or kinds touches only those. The key of
+ * entry i is the key_offsets[i+1] - key_offsets[i] bytes at
+ * keys + key_offsets[i]; its value is kinds[i] and values[i]. See
+ * amqp_compact_table_init().
+ */
+typedef struct amqp_compact_table_t_ {
+  int num_entries;
+  amqp_field_value_union_t *values;
+  uint32_t *key_offsets; /* num_entries + 1 of them */
+  char *kinds;
+  char *keys;
+} amqp_compact_table_t;
+
 typedef enum {
   AMQP_FIELD_KIND_BOOLEAN = 't',
   AMQP_FIELD_KIND_I8 = 'b',
@@ -252,22 +287,113 @@ typedef enum {
 #define AMQP_FIELD_VALUE_VOID(k)   _AMQP_FVINIT(VOID, .u8 = 0)
 #define AMQP_FIELD_VALUE_BYTES(v) _AMQP_FVINIT(BYTES, .bytes = (v))
 
+/*
+ * Memory allocation hooks. Every allocation the library makes goes
+ * through one of these: either the library-wide allocator installed
+ * with amqp_set_allocator(), or the one a connection was created with
+ * by amqp_new_connection_with_allocator(). All four functions must be
+ * supplied; each is passed the allocator's context pointer. The
+ * allocator structure is referenced, not copied, so it must outlive
+ * every pool and connection using it.
+ */
+typedef struct amqp_allocator_t_ {
+  void *(*malloc_fn)(void *context, size_t size);
+  void *(*calloc_fn)(void *context, size_t count, size_t size);
+  void *(*realloc_fn)(void *context, void *ptr, size_t size);
+  void (*free_fn)(void *context, void *ptr);
+  void *context;
+} amqp_allocator_t;
+
 typedef struct amqp_pool_blocklist_t_ {
   int num_blocks;
+  int capacity; /* slots allocated in blocklist; grows geometrically */
   void **blocklist;
 } amqp_pool_blocklist_t;
 
+/*
+ * Allocations bigger than a pool's pagesize are served from "large
+ * blocks" whose sizes are rounded up to one of AMQP_POOL_SIZE_CLASSES
+ * size classes: pagesize << 1, pagesize << 2, ... pagesize <<
+ * AMQP_POOL_SIZE_CLASSES. recycle_amqp_pool() files large blocks on
+ * per-class free lists instead of freeing them, so that a connection
+ * in steady state does not call into the system allocator at all.
+ * Blocks bigger than the largest class are freed on recycle.
+ */
+#define AMQP_POOL_SIZE_CLASSES 16
+
+/*
+ * Pool flags:
+ *
+ * - AMQP_POOL_NO_ZERO_FILL: fresh pages and large blocks are not
+ *   zeroed. Memory handed out after a recycle_amqp_pool() is never
+ *   zeroed, whatever the flags, so only use this for pools whose
+ *   users overwrite what they allocate (as the frame decoders do).
+ */
+#define AMQP_POOL_NO_ZERO_FILL 1
+/*
+ * - AMQP_POOL_LAZY_TABLES: field tables decoded into the pool are
+ *   left encoded until asked for; see AMQP_TABLE_LAZY.
+ */
+#define AMQP_POOL_LAZY_TABLES 2
+/*
+ * - AMQP_POOL_SORTED_TABLES: field tables decoded into the pool have
+ *   their entries sorted by key, ready for amqp_table_get().
+ *   Otherwise they keep the order the entries had on the wire.
+ */
+#define AMQP_POOL_SORTED_TABLES 4
+/*
+ * - AMQP_POOL_VALIDATE_UTF8: AMQP_FIELD_KIND_UTF8 values decoded into
+ *   the pool must be well-formed UTF-8, or decoding fails with
+ *   ERROR_BAD_AMQP_DATA.
+ */
+#define AMQP_POOL_VALIDATE_UTF8 8
+
+/*
+ * Memory accounting for a pool. The byte counters and the recycle
+ * count are kept up to date as the pool is used; the page and block
+ * counts are filled in by amqp_pool_get_stats().
+ */
+typedef struct amqp_pool_stats_t_ {
+  size_t bytes_in_use;      /* handed out since the last recycle */
+  size_t peak_bytes_in_use;
+  size_t bytes_held;        /* pages and large blocks owned, used or not */
+  size_t peak_bytes_held;
+  int pages_in_use;
+  int pages_held;
+  int large_blocks_in_use;
+  int large_blocks_free;
+  unsigned long recycles;
+} amqp_pool_stats_t;
+
 typedef struct amqp_pool_t_ {
   size_t pagesize;
+  int flags;
+  amqp_allocator_t const *allocator;
+
+  /* Upper bound, in bytes, on the pages and free large blocks kept
+     across recycle_amqp_pool(); 0 means keep everything. */
+  size_t high_water_mark;
 
   amqp_pool_blocklist_t pages;
   amqp_pool_blocklist_t large_blocks;
+  amqp_pool_blocklist_t free_blocks[AMQP_POOL_SIZE_CLASSES];
 
   int next_page;
   char *alloc_block;
   size_t alloc_used;
+
+  amqp_pool_stats_t stats;
 } amqp_pool_t;
 
+/* A point to rewind a pool to; see amqp_pool_mark(). */
+typedef struct amqp_pool_mark_t_ {
+  int next_page;
+  char *alloc_block;
+  size_t alloc_used;
+  int num_large_blocks;
+  size_t bytes_in_use;
+} amqp_pool_mark_t;
+
 typedef struct amqp_method_t_ {
   amqp_method_number_t id;
   void *decoded;
@@ -316,17 +442,70 @@ typedef enum amqp_sasl_method_enum_ {
 
 typedef int (*amqp_output_fn_t)(void *context, void *buffer, size_t count);
 
+/*
+ * Connection memory modes, for latency-critical connections; see
+ * amqp_set_memory_mode(). Any of the last three implies
+ * AMQP_MEMORY_MAPPED.
+ *
+ * - AMQP_MEMORY_MAPPED: pool pages and socket buffers are carved out
+ *   of anonymous memory mappings rather than the heap.
+ * - AMQP_MEMORY_HUGE_PAGES: the mappings are backed by explicit huge
+ *   pages if any are reserved, transparent huge pages otherwise.
+ * - AMQP_MEMORY_PREFAULT: the mappings are touched as they are made,
+ *   and pool pages are reserved when the connection is (re)tuned, so
+ *   that the first frames do not take page faults.
+ * - AMQP_MEMORY_LOCKED: the mappings are mlock'd.
+ */
+#define AMQP_MEMORY_MAPPED 1
+#define AMQP_MEMORY_HUGE_PAGES 2
+#define AMQP_MEMORY_PREFAULT 4
+#define AMQP_MEMORY_LOCKED 8
+
+/* A point to rewind a connection's buffers to; see amqp_mark_buffers(). */
+typedef struct amqp_buffers_mark_t_ {
+  amqp_pool_mark_t frame_pool;
+  amqp_pool_mark_t decoding_pool;
+  void const *last_queued_frame;
+  int num_retired_sock_buffers;
+  int sock_inbound_pinned;
+} amqp_buffers_mark_t;
+
+typedef struct amqp_memory_stats_t_ {
+  amqp_pool_stats_t frame_pool;
+  amqp_pool_stats_t decoding_pool;
+  size_t sock_inbound_buffer_size;
+  size_t outbound_buffer_size;
+} amqp_memory_stats_t;
+
 /* Opaque struct. */
 typedef struct amqp_connection_state_t_ *amqp_connection_state_t;
 
+/* Opaque struct: a reference-counted body fragment; see amqp_retain_body(). */
+typedef struct amqp_buffer_t_ amqp_buffer_t;
+
 /*** FUNCTIONS ***/
 
 RABBITMQ_EXPORT extern char const *amqp_version(void);
 
+RABBITMQ_EXPORT extern void amqp_set_allocator(amqp_allocator_t const *allocator);
+RABBITMQ_EXPORT extern amqp_allocator_t const *amqp_get_allocator(void);
+RABBITMQ_EXPORT extern void amqp_set_page_cache_limit(size_t bytes);
+
 RABBITMQ_EXPORT extern void init_amqp_pool(amqp_pool_t *pool, size_t pagesize);
 RABBITMQ_EXPORT extern void recycle_amqp_pool(amqp_pool_t *pool);
 RABBITMQ_EXPORT extern void empty_amqp_pool(amqp_pool_t *pool);
 
+RABBITMQ_EXPORT extern void amqp_pool_set_allocator(amqp_pool_t *pool, amqp_allocator_t const *allocator);
+RABBITMQ_EXPORT extern void amqp_pool_set_flags(amqp_pool_t *pool, int flags);
+RABBITMQ_EXPORT extern void amqp_pool_set_high_water_mark(amqp_pool_t *pool, size_t bytes);
+
+RABBITMQ_EXPORT extern int amqp_pool_reserve(amqp_pool_t *pool, int num_pages);
+
+RABBITMQ_EXPORT extern void amqp_pool_mark(amqp_pool_t const *pool, amqp_pool_mark_t *mark);
+RABBITMQ_EXPORT extern void amqp_pool_rewind(amqp_pool_t *pool, amqp_pool_mark_t const *mark);
+
+RABBITMQ_EXPORT extern void amqp_pool_get_stats(amqp_pool_t const *pool, amqp_pool_stats_t *stats);
+
 RABBITMQ_EXPORT extern void *amqp_pool_alloc(amqp_pool_t *pool, size_t amount);
 RABBITMQ_EXPORT extern void amqp_pool_alloc_bytes(amqp_pool_t *pool, size_t amount, amqp_bytes_t *output);
 
@@ -336,6 +515,7 @@ RABBITMQ_EXPORT extern amqp_bytes_t amqp_bytes_malloc(size_t amount);
 RABBITMQ_EXPORT extern void amqp_bytes_free(amqp_bytes_t bytes);
 
 RABBITMQ_EXPORT extern amqp_connection_state_t amqp_new_connection(void);
+RABBITMQ_EXPORT extern amqp_connection_state_t amqp_new_connection_with_allocator(amqp_allocator_t const *allocator);
 RABBITMQ_EXPORT extern int amqp_get_sockfd(amqp_connection_state_t state);
 RABBITMQ_EXPORT extern void amqp_set_sockfd(amqp_connection_state_t state,
 			    int sockfd);
@@ -344,8 +524,42 @@ RABBITMQ_EXPORT extern int amqp_tune_connection(amqp_connection_state_t state,
 				int frame_max,
 				int heartbeat);
 RABBITMQ_EXPORT extern int amqp_get_channel_max(amqp_connection_state_t state);
+RABBITMQ_EXPORT extern void amqp_set_pool_high_water_marks(amqp_connection_state_t state,
+					   size_t frame_pool_bytes,
+					   size_t decoding_pool_bytes);
+
+/*
+ * Leaves field tables in received methods and content headers
+ * encoded until they are looked into; see AMQP_TABLE_LAZY. Off by
+ * default.
+ */
+RABBITMQ_EXPORT extern void amqp_set_lazy_tables(amqp_connection_state_t state,
+						 amqp_boolean_t lazy);
+
+/*
+ * Sorts the entries of field tables in received methods and content
+ * headers by key, so that amqp_table_get() can be used on them. Off
+ * by default, when tables keep their wire order. Combined with
+ * amqp_set_lazy_tables(), tables are sorted when they are
+ * materialized into the decoding pool.
+ */
+RABBITMQ_EXPORT extern void amqp_set_sorted_tables(amqp_connection_state_t state,
+						   amqp_boolean_t sorted);
+
+/*
+ * Rejects received field tables holding AMQP_FIELD_KIND_UTF8 values
+ * that are not well-formed UTF-8. Off by default. Lazy tables are
+ * checked as their values are decoded.
+ */
+RABBITMQ_EXPORT extern void amqp_set_utf8_validation(amqp_connection_state_t state,
+						     amqp_boolean_t validate);
+RABBITMQ_EXPORT extern int amqp_set_memory_mode(amqp_connection_state_t state, int flags);
+RABBITMQ_EXPORT extern int amqp_get_memory_mode(amqp_connection_state_t state);
 RABBITMQ_EXPORT extern int amqp_destroy_connection(amqp_connection_state_t state);
 
+RABBITMQ_EXPORT extern void amqp_get_memory_stats(amqp_connection_state_t state,
+				  amqp_memory_stats_t *stats);
+
 RABBITMQ_EXPORT extern int amqp_handle_input(amqp_connection_state_t state,
 			     amqp_bytes_t received_data,
 			     amqp_frame_t *decoded_frame);
@@ -356,6 +570,19 @@ RABBITMQ_EXPORT extern void amqp_release_buffers(amqp_connection_state_t state);
 
 RABBITMQ_EXPORT extern void amqp_maybe_release_buffers(amqp_connection_state_t state);
 
+RABBITMQ_EXPORT extern amqp_buffer_t *amqp_retain_body(amqp_connection_state_t state,
+				       amqp_frame_t const *frame);
+RABBITMQ_EXPORT extern amqp_bytes_t amqp_buffer_bytes(amqp_buffer_t const *buffer);
+RABBITMQ_EXPORT extern void amqp_buffer_retain(amqp_buffer_t *buffer);
+RABBITMQ_EXPORT extern void amqp_buffer_release(amqp_buffer_t *buffer);
+
+RABBITMQ_EXPORT extern void amqp_mark_buffers(amqp_connection_state_t state,
+			      amqp_buffers_mark_t *mark);
+RABBITMQ_EXPORT extern amqp_boolean_t amqp_rewind_buffers_ok(amqp_connection_state_t state,
+					     amqp_buffers_mark_t const *mark);
+RABBITMQ_EXPORT extern void amqp_rewind_buffers(amqp_connection_state_t state,
+				amqp_buffers_mark_t const *mark);
+
 RABBITMQ_EXPORT extern int amqp_send_frame(amqp_connection_state_t state,
 			   amqp_frame_t const *frame);
 RABBITMQ_EXPORT extern int amqp_send_frame_to(amqp_connection_state_t state,
@@ -363,8 +590,96 @@ RABBITMQ_EXPORT extern int amqp_send_frame_to(amqp_connection_state_t state,
 			      amqp_output_fn_t fn,
 			      void *context);
 
+/*
+ * Write coalescing: amqp_send_frame collects frames and sends them
+ * together once max_bytes of them are waiting, the oldest has waited
+ * max_delay_usec (0 for no deadline), the connection is about to
+ * read, or amqp_flush is called. The deadline is only checked when
+ * the library is called, so a sender that goes quiet must flush.
+ * Off (max_bytes 0) by default. amqp_send_frame_to never coalesces.
+ */
+RABBITMQ_EXPORT extern int amqp_set_write_coalescing(amqp_connection_state_t state,
+						     size_t max_bytes,
+						     int max_delay_usec);
+RABBITMQ_EXPORT extern int amqp_flush(amqp_connection_state_t state);
+
 RABBITMQ_EXPORT extern int amqp_table_entry_cmp(void const *entry1, void const *entry2);
 
+/*
+ * Looks key up in a table, lazy or not, and stores its value. Only
+ * that value is decoded out of a lazy table, into pool, and a table
+ * nested in it is left lazy in turn. Returns 1 if found, 0 if not,
+ * or a negative error code if the table turns out to be malformed.
+ */
+RABBITMQ_EXPORT extern int amqp_table_find(amqp_table_t const *table,
+					   amqp_bytes_t key,
+					   amqp_pool_t *pool,
+					   amqp_field_value_t *value);
+RABBITMQ_EXPORT extern amqp_boolean_t amqp_table_is_lazy(amqp_table_t const *table);
+/* Decodes a lazy table in full, nested tables included, into pool. */
+RABBITMQ_EXPORT extern int amqp_table_materialize(amqp_table_t *table, amqp_pool_t *pool);
+
+/*
+ * Key lookup by binary search. The table must be sorted by key, as
+ * amqp_table_sort() leaves it and tables decoded with
+ * AMQP_POOL_SORTED_TABLES are; in any other table a key that is there
+ * may not be found. A lazy table has no entries to search, so both
+ * find nothing in one: use amqp_table_find() on it, or materialize it
+ * first.
+ * amqp_table_get_path() follows keys through nested tables. Both
+ * return NULL if there is no such key, and a pointer into the table
+ * otherwise.
+ */
+RABBITMQ_EXPORT extern void amqp_table_sort(amqp_table_t *table);
+RABBITMQ_EXPORT extern amqp_field_value_t *amqp_table_get(amqp_table_t const *table,
+							 amqp_bytes_t key);
+RABBITMQ_EXPORT extern amqp_field_value_t *amqp_table_get_path(amqp_table_t const *table,
+							      amqp_bytes_t const *keys,
+							      int num_keys);
+
+/*
+ * Compact tables. amqp_compact_table_init() lays a table out in pool;
+ * a lazy table is decoded straight into the compact form. The keys
+ * are copied, strings and nested tables are not: the compact table
+ * lives as long as both the pool and the table's own data. It
+ * returns 0 or a negative error code. amqp_compact_table_find()
+ * returns the index of key, or -1. amqp_compact_table_to_table()
+ * goes back to a plain table, which shares the compact table's keys
+ * and data.
+ */
+RABBITMQ_EXPORT extern int amqp_compact_table_init(amqp_compact_table_t *compact,
+						   amqp_table_t const *table,
+						   amqp_pool_t *pool);
+RABBITMQ_EXPORT extern int amqp_compact_table_find(amqp_compact_table_t const *compact,
+						   amqp_bytes_t key);
+RABBITMQ_EXPORT extern int amqp_compact_table_to_table(amqp_table_t *table,
+						       amqp_compact_table_t const *compact,
+						       amqp_pool_t *pool);
+
+/* Whether bytes are well-formed UTF-8. */
+RABBITMQ_EXPORT extern amqp_boolean_t amqp_utf8_valid(amqp_bytes_t bytes);
+
+/*
+ * The exact size of a table's wire form, size prefix included, or 0
+ * (which no table encodes to) if it holds a value of unknown kind.
+ */
+RABBITMQ_EXPORT extern size_t amqp_table_encoded_size(amqp_table_t const *table);
+
+/*
+ * Encodes a table once, into memory from the library-wide allocator,
+ * for tables sent over and over again unchanged. amqp_encoded_table_get()
+ * returns a lazy table over the encoding (see AMQP_TABLE_LAZY) that
+ * can be passed anywhere an amqp_table_t is sent, such as declare
+ * arguments or the headers of basic properties: it costs a single
+ * memcpy to encode. It stays valid until amqp_encoded_table_destroy().
+ * amqp_encoded_table_init() returns 0, or a negative error code if
+ * out of memory or if the table holds a value of unknown kind.
+ */
+RABBITMQ_EXPORT extern int amqp_encoded_table_init(amqp_encoded_table_t *encoded,
+						   amqp_table_t const *table);
+RABBITMQ_EXPORT extern void amqp_encoded_table_destroy(amqp_encoded_table_t *encoded);
+RABBITMQ_EXPORT extern amqp_table_t amqp_encoded_table_get(amqp_encoded_table_t const *encoded);
+
 RABBITMQ_EXPORT extern int amqp_open_socket(char const *hostname, int portnumber);
 
 RABBITMQ_EXPORT extern int amqp_send_header(amqp_connection_state_t state);
@@ -377,6 +692,13 @@ RABBITMQ_EXPORT extern amqp_boolean_t amqp_frames_enqueued(amqp_connection_state
 RABBITMQ_EXPORT extern int amqp_simple_wait_frame(amqp_connection_state_t state,
 				  amqp_frame_t *decoded_frame);
 
+struct timeval;
+
+RABBITMQ_EXPORT extern int amqp_wait_frames(amqp_connection_state_t state,
+					    amqp_frame_t *frames,
+					    int max,
+					    struct timeval *timeout);
+
 RABBITMQ_EXPORT extern int amqp_simple_wait_method(amqp_connection_state_t state,
 				   amqp_channel_t expected_channel,
 				   amqp_method_number_t expected_method,
@@ -435,6 +757,45 @@ RABBITMQ_EXPORT extern int amqp_basic_publish(amqp_connection_state_t state,
 			      struct amqp_basic_properties_t_ const *properties,
 			      amqp_bytes_t body);
 
+/*
+ * amqp_basic_publish for a body made up of num_segments segments,
+ * which are sent as they lie, without being concatenated first.
+ */
+RABBITMQ_EXPORT extern int amqp_basic_publish_iov(amqp_connection_state_t state,
+						  amqp_channel_t channel,
+						  amqp_bytes_t exchange,
+						  amqp_bytes_t routing_key,
+						  amqp_boolean_t mandatory,
+						  amqp_boolean_t immediate,
+						  struct amqp_basic_properties_t_ const *properties,
+						  amqp_bytes_t const *body,
+						  int num_segments);
+
+/* One message of an amqp_basic_publish_batch. */
+typedef struct amqp_message_t_ {
+  amqp_bytes_t exchange;
+  amqp_bytes_t routing_key;
+  amqp_boolean_t mandatory;
+  amqp_boolean_t immediate;
+  struct amqp_basic_properties_t_ const *properties; /* may be NULL */
+  amqp_bytes_t body;
+} amqp_message_t;
+
+/*
+ * Publishes num_messages messages on channel, in order, with as few
+ * writes as the outbound buffer allows. A message that cannot be
+ * encoded is skipped; the others are still sent. If status is not
+ * NULL, status[i] is set to 0 if message i was sent and to a negative
+ * error code if not. Returns 0 if every message was sent, otherwise
+ * the error of a failed write, or else that of the first message
+ * skipped.
+ */
+RABBITMQ_EXPORT extern int amqp_basic_publish_batch(amqp_connection_state_t state,
+						    amqp_channel_t channel,
+						    amqp_message_t const *messages,
+						    size_t num_messages,
+						    int *status);
+
 RABBITMQ_EXPORT extern amqp_rpc_reply_t amqp_channel_close(amqp_connection_state_t state,
 					   amqp_channel_t channel,
 					   int code);
@@ -562,6 +923,16 @@ extern void amqp_log_error( char *pcFile, int nLine, int nPrio, int nError, char
 RABBITMQ_EXPORT extern void amqp_clear_error( void );
 RABBITMQ_EXPORT extern int  amqp_get_error(void);
 
+/*
+ * The error state above belongs to the calling thread. The last
+ * error of a particular connection - set by whichever thread drove
+ * it, and cleared at the start of each amqp_api.c call on it - is
+ * kept with the connection itself. Both are positive error codes,
+ * or 0 when there is none.
+ */
+RABBITMQ_EXPORT extern int  amqp_get_connection_error(amqp_connection_state_t state);
+RABBITMQ_EXPORT extern void amqp_clear_connection_error(amqp_connection_state_t state);
+
 /*
  * Returns the name of this library
  */
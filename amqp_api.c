@@ -60,21 +60,36 @@
 #include "amqp_private.h"
 
 static const char *client_error_strings[ERROR_MAX + 1] = {
-  "No error."                                 /* OK                              */
+  "No error.",                                /* OK                              */
   "Could not allocate memory.",               /* ERROR_NO_MEMORY                 */
   "Received bad AMQP data.",                  /* ERROR_BAD_AQMP_DATA             */
   "Unknown AMQP class id.",                   /* ERROR_UNKOWN_CLASS              */
   "Unknown AMQP method id.",                  /* ERROR_UNKOWN_METHOD             */
   "Unknown host.",                            /* ERROR_GETHOSTBYNAME_FAILED      */
   "Incompatible AMQP version.",               /* ERROR_INCOMPATIBLE_AMQP_VERSION */
-  "Connection closed unexpectedly."           /* ERROR_CONNECTION_CLOSED         */
+  "Connection closed unexpectedly.",          /* ERROR_CONNECTION_CLOSED         */
+  "Value out of bounds.",                     /* ERROR_LIMIT_OUT_OF_BOUNDS       */
+  "Frame larger than frame_max."              /* ERROR_FRAME_TOO_LARGE           */
 };
 
 static char        *gpcLibName  = NULL;
 static int          gbLibOpened = 0;
 static pfnLogFn_t   gpfnLogFn   = NULL;
 
-extern int g_errno;
+/* The allocator gpcLibName came from, to free it with. */
+static amqp_allocator_t const *gpLibNameAllocator = NULL;
+
+static char *amqp_lib_strdup( char const *pcStr )
+{
+  size_t nLen = strlen( pcStr ) + 1;
+  char  *pcCopy;
+
+  gpLibNameAllocator = amqp_get_allocator();
+  pcCopy = amqp_malloc( gpLibNameAllocator, nLen );
+  if( pcCopy != NULL )
+    memcpy( pcCopy, pcStr, nLen );
+  return pcCopy;
+}
 
 RABBITMQ_EXPORT char *amqp_libname( void )
 {
@@ -96,9 +111,9 @@ RABBITMQ_EXPORT void amqp_lib_open( pfnLogFn_t pLogFn, int nLogLevel, int nFacil
   if( gbLibOpened == 0 )
   {
 	if( pcName != NULL )
-	  gpcLibName = strdup( pcName );
+	  gpcLibName = amqp_lib_strdup( pcName );
 	else
-	  gpcLibName = strdup( DEFAULT_LIB_NAME );
+	  gpcLibName = amqp_lib_strdup( DEFAULT_LIB_NAME );
 
     amqp_openlog( pLogFn, nLogLevel, nFacility, pcName );
     amqp_log( __FILE__, __LINE__, LOG_NOTICE, "Library %s opened and initialized.", amqp_libname() );
@@ -108,13 +123,13 @@ RABBITMQ_EXPORT void amqp_lib_open( pfnLogFn_t pLogFn, int nLogLevel, int nFacil
 
 RABBITMQ_EXPORT void amqp_lib_close( void )
 {
-  if( gbLibOpened == 0 )
+  if( gbLibOpened != 0 )
   {
     amqp_log( __FILE__, __LINE__, LOG_NOTICE, "Library %s closed.", amqp_libname() );
     amqp_closelog();
     if( gpcLibName != NULL )
     {
-      free( gpcLibName);
+      amqp_free( gpLibNameAllocator, gpcLibName );
       gpcLibName = NULL;
     }
     gbLibOpened = 0;
@@ -123,7 +138,7 @@ RABBITMQ_EXPORT void amqp_lib_close( void )
 
 RABBITMQ_EXPORT void amgp_log( char *pcFile, int nLine, int nPrio, char *pcFormat, ...)
 {
-  static char acBuffer[ MAX_BUFFER_SIZE ];
+  static AMQP_THREAD_LOCAL char acBuffer[ MAX_BUFFER_SIZE ];
 
   va_list vArgs;
   va_start(vArgs, pcFormat);
@@ -186,7 +201,7 @@ RABBITMQ_EXPORT amqp_channel_open_ok_t *amqp_channel_open(amqp_connection_state_
   bytes.bytes = NULL;
   bytes.len   = 0;
 
-  amqp_clear_error();
+  amqp_clear_connection_error(state);
 
   _simple_rpc_request__.out_of_band = bytes;
 
@@ -208,62 +223,119 @@ RABBITMQ_EXPORT int amqp_basic_publish(amqp_connection_state_t state,
 		                               amqp_basic_properties_t const *properties,
 		                               amqp_bytes_t body)
 {
-  int                     result              = OK;
-  amqp_frame_t            f;
-  size_t                  body_offset;
+  return amqp_basic_publish_iov(state, channel, exchange, routing_key,
+				mandatory, immediate, properties, &body, 1);
+}
+
+/*
+ * Publishes a message whose body is the concatenation of num_segments
+ * segments, without copying them: body frames are cut wherever
+ * frame_max falls, across segment boundaries, and the whole message
+ * goes out in a single write where possible.
+ */
+RABBITMQ_EXPORT int amqp_basic_publish_iov(amqp_connection_state_t state,
+					   amqp_channel_t channel,
+					   amqp_bytes_t exchange,
+					   amqp_bytes_t routing_key,
+					   amqp_boolean_t mandatory,
+					   amqp_boolean_t immediate,
+					   amqp_basic_properties_t const *properties,
+					   amqp_bytes_t const *body,
+					   int num_segments)
+{
+  amqp_frame_t            f[2];
   amqp_basic_properties_t default_properties;
-  size_t                  usable_body_payload_size = state->frame_max - (HEADER_SIZE + FOOTER_SIZE);
   amqp_basic_publish_t    m;
+  size_t                  body_size = 0;
+  int                     i;
 
-  amqp_clear_error();
+  amqp_clear_connection_error(state);
 
   m.exchange    = exchange;
   m.routing_key = routing_key;
   m.immediate   = immediate;
   m.mandatory   = mandatory;
 
-  result = amqp_send_method(state, channel, AMQP_BASIC_PUBLISH_METHOD, &m);
-  if( result < 0 )
-	return result;
+  f[0].frame_type = AMQP_FRAME_METHOD;
+  f[0].channel = channel;
+  f[0].payload.method.id = AMQP_BASIC_PUBLISH_METHOD;
+  f[0].payload.method.decoded = &m;
 
   if (properties == NULL) {
     memset(&default_properties, 0, sizeof(default_properties));
     properties = &default_properties;
   }
 
-  f.frame_type = AMQP_FRAME_HEADER;
-  f.channel = channel;
-  f.payload.properties.class_id = AMQP_BASIC_CLASS;
-  f.payload.properties.body_size = body.len;
-  f.payload.properties.decoded = (void *) properties;
-  result = amqp_send_frame(state, &f);
-  if( result < 0 )
-	return result;
-
-  body_offset = 0;
-  while (1) {
-    int remaining = body.len - body_offset;
-    assert(remaining >= 0);
-
-    if (remaining == 0)
-      break;
-
-    f.frame_type = AMQP_FRAME_BODY;
-    f.channel = channel;
-    f.payload.body_fragment.bytes = buf_at(body, body_offset);
-    if (remaining >= usable_body_payload_size) {
-      f.payload.body_fragment.len = usable_body_payload_size;
-    } else {
-      f.payload.body_fragment.len = remaining;
-    }
-
-    body_offset += f.payload.body_fragment.len;
-    result = amqp_send_frame(state, &f);
-    if( result < 0 )
-      return result;
+  for (i = 0; i < num_segments; i++) {
+    body_size += body[i].len;
   }
 
-  return 0;
+  f[1].frame_type = AMQP_FRAME_HEADER;
+  f[1].channel = channel;
+  f[1].payload.properties.class_id = AMQP_BASIC_CLASS;
+  f[1].payload.properties.body_size = body_size;
+  f[1].payload.properties.decoded = (void *) properties;
+
+  return amqp_send_message(state, f, 2, channel, body, num_segments);
+}
+
+typedef struct publish_batch_t_ {
+  amqp_channel_t          channel;
+  amqp_message_t const    *messages;
+  amqp_basic_publish_t    method;
+  amqp_basic_properties_t default_properties;
+} publish_batch_t;
+
+static void publish_batch_message(void *context,
+				  size_t i,
+				  amqp_frame_t *frames,
+				  amqp_bytes_t *body)
+{
+  publish_batch_t      *batch   = context;
+  amqp_message_t const *message = &batch->messages[i];
+
+  batch->method.exchange    = message->exchange;
+  batch->method.routing_key = message->routing_key;
+  batch->method.immediate   = message->immediate;
+  batch->method.mandatory   = message->mandatory;
+
+  frames[0].frame_type = AMQP_FRAME_METHOD;
+  frames[0].channel = batch->channel;
+  frames[0].payload.method.id = AMQP_BASIC_PUBLISH_METHOD;
+  frames[0].payload.method.decoded = &batch->method;
+
+  frames[1].frame_type = AMQP_FRAME_HEADER;
+  frames[1].channel = batch->channel;
+  frames[1].payload.properties.class_id = AMQP_BASIC_CLASS;
+  frames[1].payload.properties.body_size = message->body.len;
+  frames[1].payload.properties.decoded = (void *) (message->properties != NULL
+						   ? message->properties
+						   : &batch->default_properties);
+
+  *body = message->body;
+}
+
+/*
+ * Publishes a batch of messages, encoding them one after another into
+ * the outbound buffer so that they go out together: one write per
+ * buffer's worth rather than one per message.
+ */
+RABBITMQ_EXPORT int amqp_basic_publish_batch(amqp_connection_state_t state,
+					     amqp_channel_t channel,
+					     amqp_message_t const *messages,
+					     size_t num_messages,
+					     int *status)
+{
+  publish_batch_t batch;
+
+  amqp_clear_connection_error(state);
+
+  batch.channel = channel;
+  batch.messages = messages;
+  memset(&batch.default_properties, 0, sizeof(batch.default_properties));
+
+  return amqp_send_messages(state, channel, num_messages,
+			    publish_batch_message, &batch, status);
 }
 
 RABBITMQ_EXPORT amqp_rpc_reply_t amqp_channel_close(amqp_connection_state_t state,
@@ -280,7 +352,7 @@ RABBITMQ_EXPORT amqp_rpc_reply_t amqp_channel_close(amqp_connection_state_t stat
   bytes.len   = 0;
   memset( codestr, 0, 13 );
 
-  amqp_clear_error();
+  amqp_clear_connection_error(state);
 
   snprintf(codestr, sizeof(codestr), "%d", code);
 
@@ -310,7 +382,7 @@ RABBITMQ_EXPORT amqp_rpc_reply_t amqp_connection_close(amqp_connection_state_t s
   bytes.len   = 0;
   memset( codestr, 0, 13 );
 
-  amqp_clear_error();
+  amqp_clear_connection_error(state);
 
   snprintf(codestr, sizeof(codestr), "%d", code);
 
@@ -339,7 +411,7 @@ RABBITMQ_EXPORT amqp_exchange_declare_ok_t *amqp_exchange_declare(amqp_connectio
   amqp_exchange_declare_t  _simple_rpc_request__;
   amqp_method_number_t     _replies__[2]          = { AMQP_EXPAND_METHOD(EXCHANGE,DECLARE_OK), 0};
 	  
-  amqp_clear_error();
+  amqp_clear_connection_error(state);
 
   _simple_rpc_request__.exchange    = exchange;
   _simple_rpc_request__.type        = type; 
@@ -369,7 +441,7 @@ RABBITMQ_EXPORT amqp_queue_declare_ok_t *amqp_queue_declare(amqp_connection_stat
   amqp_queue_declare_t  _simple_rpc_request__;
   amqp_method_number_t  _replies__[2]          = { AMQP_EXPAND_METHOD(QUEUE,DECLARE_OK), 0};
 	  
-  amqp_clear_error();
+  amqp_clear_connection_error(state);
 
   _simple_rpc_request__.ticket      = 0;
   _simple_rpc_request__.queue       = queue;
@@ -395,7 +467,7 @@ RABBITMQ_EXPORT amqp_queue_delete_ok_t *amqp_queue_delete(amqp_connection_state_
   amqp_queue_delete_t  _simple_rpc_request__;
   amqp_method_number_t _replies__[2]          = { AMQP_EXPAND_METHOD(QUEUE,DELETE_OK), 0};
 	  
-  amqp_clear_error();
+  amqp_clear_connection_error(state);
 
   _simple_rpc_request__.ticket      = 0;
   _simple_rpc_request__.queue       = queue;
@@ -420,7 +492,7 @@ RABBITMQ_EXPORT amqp_queue_bind_ok_t *amqp_queue_bind(amqp_connection_state_t st
   amqp_queue_bind_t    _simple_rpc_request__;
   amqp_method_number_t _replies__[2]          = { AMQP_EXPAND_METHOD(QUEUE,BIND_OK), 0};
 	  
-  amqp_clear_error();
+  amqp_clear_connection_error(state);
 
   _simple_rpc_request__.ticket      = 0;
   _simple_rpc_request__.queue       = queue;
@@ -446,7 +518,7 @@ RABBITMQ_EXPORT amqp_queue_unbind_ok_t *amqp_queue_unbind(amqp_connection_state_
   amqp_queue_unbind_t   _simple_rpc_request__;
   amqp_method_number_t  _replies__[2]          = { AMQP_EXPAND_METHOD(QUEUE,UNBIND_OK), 0};
 	  
-  amqp_clear_error();
+  amqp_clear_connection_error(state);
 
   _simple_rpc_request__.ticket      = 0;
   _simple_rpc_request__.queue       = queue;
@@ -472,7 +544,7 @@ RABBITMQ_EXPORT amqp_basic_consume_ok_t *amqp_basic_consume(amqp_connection_stat
   amqp_basic_consume_t _simple_rpc_request__;
   amqp_method_number_t _replies__[2]          = { AMQP_EXPAND_METHOD(BASIC,CONSUME_OK), 0};
 	  
-  amqp_clear_error();
+  amqp_clear_connection_error(state);
 
   _simple_rpc_request__.ticket        = 0;
   _simple_rpc_request__.queue         = queue;
@@ -497,7 +569,7 @@ RABBITMQ_EXPORT int amqp_basic_ack(amqp_connection_state_t state,
   int              result = OK;
   amqp_basic_ack_t m;
 
-  amqp_clear_error();
+  amqp_clear_connection_error(state);
 
   m.delivery_tag = delivery_tag;
   m.multiple     = multiple;
@@ -514,7 +586,7 @@ RABBITMQ_EXPORT amqp_queue_purge_ok_t *amqp_queue_purge(amqp_connection_state_t
   amqp_queue_purge_t   _simple_rpc_request__;
   amqp_method_number_t _replies__[2]          = { AMQP_EXPAND_METHOD(QUEUE,PURGE_OK), 0};
 	  
-  amqp_clear_error();
+  amqp_clear_connection_error(state);
 
   _simple_rpc_request__.ticket = 0;
   _simple_rpc_request__.queue  = queue;
@@ -536,7 +608,7 @@ RABBITMQ_EXPORT amqp_rpc_reply_t amqp_basic_get(amqp_connection_state_t state,
   amqp_method_number_t replies[]              = { AMQP_BASIC_GET_OK_METHOD,
 				                                  AMQP_BASIC_GET_EMPTY_METHOD,
 				                                  0 };
-  amqp_clear_error();
+  amqp_clear_connection_error(state);
 
   _simple_rpc_request__.ticket = 0;
   _simple_rpc_request__.queue  = queue;
@@ -555,7 +627,7 @@ RABBITMQ_EXPORT amqp_tx_select_ok_t *amqp_tx_select(amqp_connection_state_t stat
   amqp_tx_select_t     _simple_rpc_request__;
   amqp_method_number_t _replies__[2]          = { AMQP_EXPAND_METHOD(TX,SELECT_OK), 0};
 	  
-  amqp_clear_error();
+  amqp_clear_connection_error(state);
 
   state->most_recent_api_result = amqp_simple_rpc( state, channel,
 	                                               AMQP_EXPAND_METHOD(TX,SELECT),
@@ -570,7 +642,7 @@ RABBITMQ_EXPORT amqp_tx_commit_ok_t *amqp_tx_commit(amqp_connection_state_t stat
   amqp_tx_commit_t     _simple_rpc_request__;
   amqp_method_number_t _replies__[2]          = { AMQP_EXPAND_METHOD(TX,COMMIT_OK), 0};
 	  
-  amqp_clear_error();
+  amqp_clear_connection_error(state);
 
   state->most_recent_api_result = amqp_simple_rpc( state, channel,
 	                                               AMQP_EXPAND_METHOD(TX,COMMIT),
@@ -585,7 +657,7 @@ RABBITMQ_EXPORT amqp_tx_rollback_ok_t *amqp_tx_rollback(amqp_connection_state_t
   amqp_tx_rollback_t   _simple_rpc_request__;
   amqp_method_number_t _replies__[2]          = { AMQP_EXPAND_METHOD(TX,ROLLBACK_OK), 0};
 	  
-  amqp_clear_error();
+  amqp_clear_connection_error(state);
   
   state->most_recent_api_result = amqp_simple_rpc( state, channel,
 	                                               AMQP_EXPAND_METHOD(TX,ROLLBACK),
@@ -63,6 +63,18 @@
 #define INITIAL_FRAME_POOL_PAGE_SIZE 65536
 #define INITIAL_DECODING_POOL_PAGE_SIZE 131072
 #define INITIAL_INBOUND_SOCK_BUFFER_SIZE 131072
+#define MIN_INBOUND_SOCK_BUFFER_SIZE 16384
+#define MAX_INBOUND_SOCK_BUFFER_SIZE 4194304
+
+/* Reads in a row that fill the socket buffer before it is doubled,
+   and that use less than an eighth of it before it is halved. */
+#define SOCK_BUFFER_GROW_READS 4
+#define SOCK_BUFFER_SHRINK_READS 64
+
+/* Pool pages reserved up front under AMQP_MEMORY_PREFAULT: a frame
+   being read plus one queued, and the page its methods decode into. */
+#define PREFAULT_FRAME_POOL_PAGES 2
+#define PREFAULT_DECODING_POOL_PAGES 1
 
 #define ENFORCE_STATE(statevec, statenum)				\
   {									\
@@ -75,24 +87,53 @@
   }
 
 amqp_connection_state_t amqp_new_connection(void) {
-  amqp_connection_state_t state =
-    (amqp_connection_state_t) calloc(1, sizeof(struct amqp_connection_state_t_));
+  return amqp_new_connection_with_allocator(NULL);
+}
+
+/*
+ * Creates a connection whose pools and buffers are all allocated
+ * through the given allocator (the library-wide one if NULL).
+ */
+amqp_connection_state_t amqp_new_connection_with_allocator(amqp_allocator_t const *allocator) {
+  amqp_connection_state_t state;
+
+  if (allocator == NULL) {
+    allocator = amqp_get_allocator();
+  }
 
+  state = (amqp_connection_state_t) amqp_calloc(allocator, 1, sizeof(struct amqp_connection_state_t_));
   if (state == NULL) {
     return NULL;
   }
 
+  state->allocator = allocator;
+  state->buffer_allocator = allocator;
+
   init_amqp_pool(&state->frame_pool, INITIAL_FRAME_POOL_PAGE_SIZE);
   init_amqp_pool(&state->decoding_pool, INITIAL_DECODING_POOL_PAGE_SIZE);
+  amqp_pool_set_allocator(&state->frame_pool, allocator);
+  amqp_pool_set_allocator(&state->decoding_pool, allocator);
+
+  /* Inbound frames are copied over their buffer before being read,
+     and the decoders only hand out fields they have filled in (unset
+     properties are masked by _flags), so neither pool needs zeroed
+     memory. */
+  amqp_pool_set_flags(&state->frame_pool, AMQP_POOL_NO_ZERO_FILL);
+  amqp_pool_set_flags(&state->decoding_pool, AMQP_POOL_NO_ZERO_FILL);
 
   state->state = CONNECTION_STATE_IDLE;
 
   state->inbound_buffer.bytes = NULL;
   state->outbound_buffer.bytes = NULL;
+  state->outbound_buffer.len = 0;
+  state->pending_output.bytes = NULL;
+  state->pending_output.len = 0;
+  state->pending_output_len = 0;
+  state->flush_delay_usec = 0;
   if (amqp_tune_connection(state, 0, INITIAL_FRAME_POOL_PAGE_SIZE, 0) != 0) {
     empty_amqp_pool(&state->frame_pool);
     empty_amqp_pool(&state->decoding_pool);
-    free(state);
+    amqp_free(allocator, state);
     return NULL;
   }
 
@@ -101,7 +142,7 @@ amqp_connection_state_t amqp_new_connection(void) {
 
   state->sockfd = -1;
   state->sock_inbound_buffer.len = INITIAL_INBOUND_SOCK_BUFFER_SIZE;
-  state->sock_inbound_buffer.bytes = malloc(INITIAL_INBOUND_SOCK_BUFFER_SIZE);
+  state->sock_inbound_buffer.bytes = amqp_cached_malloc(state->buffer_allocator, INITIAL_INBOUND_SOCK_BUFFER_SIZE);
   if (state->sock_inbound_buffer.bytes == NULL) {
     amqp_destroy_connection(state);
     return NULL;
@@ -109,10 +150,24 @@ amqp_connection_state_t amqp_new_connection(void) {
 
   state->sock_inbound_offset = 0;
   state->sock_inbound_limit = 0;
+  state->sock_inbound_pinned = 0;
+  state->retired_sock_buffers = NULL;
+  state->num_retired_sock_buffers = 0;
+  state->max_retired_sock_buffers = 0;
+  state->spare_sock_buffer.bytes = NULL;
+  state->spare_sock_buffer.len = 0;
+  state->shared_sock_buffers = NULL;
+  state->sock_inbound_full_reads = 0;
+  state->sock_inbound_small_reads = 0;
 
   state->first_queued_frame = NULL;
   state->last_queued_frame = NULL;
 
+  state->retained_buffers = NULL;
+  state->spare_buffers = NULL;
+
+  state->last_error = OK;
+
   return state;
 }
 
@@ -120,12 +175,40 @@ int amqp_get_sockfd(amqp_connection_state_t state) {
   return state->sockfd;
 }
 
+int amqp_get_connection_error(amqp_connection_state_t state) {
+  return state->last_error;
+}
+
+void amqp_clear_connection_error(amqp_connection_state_t state) {
+  state->last_error = OK;
+  amqp_set_error(OK);
+}
+
 void amqp_set_sockfd(amqp_connection_state_t state,
 		     int sockfd)
 {
   state->sockfd = sockfd;
 }
 
+/*
+ * Replaces one of the connection's pools with an empty one of the
+ * given page size, drawing on the connection's buffer allocator and
+ * keeping the old pool's flags and high-water mark.
+ */
+static void reset_pool(amqp_connection_state_t state,
+		       amqp_pool_t *pool,
+		       size_t pagesize)
+{
+  int flags = pool->flags;
+  size_t high_water_mark = pool->high_water_mark;
+
+  empty_amqp_pool(pool);
+  init_amqp_pool(pool, pagesize);
+  amqp_pool_set_allocator(pool, state->buffer_allocator);
+  amqp_pool_set_flags(pool, flags);
+  amqp_pool_set_high_water_mark(pool, high_water_mark);
+}
+
 int amqp_tune_connection(amqp_connection_state_t state,
 			 int channel_max,
 			 int frame_max,
@@ -139,17 +222,24 @@ int amqp_tune_connection(amqp_connection_state_t state,
   state->frame_max = frame_max;
   state->heartbeat = heartbeat;
 
-  empty_amqp_pool(&state->frame_pool);
-  init_amqp_pool(&state->frame_pool, frame_max);
+  reset_pool(state, &state->frame_pool, frame_max);
+  if (state->memory_mode & AMQP_MEMORY_PREFAULT) {
+    /* Best effort: pages not reserved now are allocated on demand. */
+    amqp_pool_reserve(&state->frame_pool, PREFAULT_FRAME_POOL_PAGES);
+  }
 
   state->inbound_buffer.len = frame_max;
-  state->outbound_buffer.len = frame_max;
-  newbuf = realloc(state->outbound_buffer.bytes, frame_max);
+
+  /* The outbound buffer holds nothing between frames, so it is
+     replaced rather than reallocated. */
+  newbuf = amqp_cached_malloc(state->buffer_allocator, frame_max);
   if (newbuf == NULL) {
     amqp_destroy_connection(state);
     return -ERROR_NO_MEMORY;
   }
+  amqp_cached_free(state->buffer_allocator, state->outbound_buffer.bytes, state->outbound_buffer.len);
   state->outbound_buffer.bytes = newbuf;
+  state->outbound_buffer.len = frame_max;
 
   return 0;
 }
@@ -158,14 +248,354 @@ int amqp_get_channel_max(amqp_connection_state_t state) {
   return state->channel_max;
 }
 
+void amqp_set_pool_high_water_marks(amqp_connection_state_t state,
+				    size_t frame_pool_bytes,
+				    size_t decoding_pool_bytes)
+{
+  amqp_pool_set_high_water_mark(&state->frame_pool, frame_pool_bytes);
+  amqp_pool_set_high_water_mark(&state->decoding_pool, decoding_pool_bytes);
+}
+
+void amqp_set_lazy_tables(amqp_connection_state_t state, amqp_boolean_t lazy) {
+  int flags = state->decoding_pool.flags & ~AMQP_POOL_LAZY_TABLES;
+  amqp_pool_set_flags(&state->decoding_pool, lazy ? flags | AMQP_POOL_LAZY_TABLES : flags);
+}
+
+void amqp_set_sorted_tables(amqp_connection_state_t state, amqp_boolean_t sorted) {
+  int flags = state->decoding_pool.flags & ~AMQP_POOL_SORTED_TABLES;
+  amqp_pool_set_flags(&state->decoding_pool, sorted ? flags | AMQP_POOL_SORTED_TABLES : flags);
+}
+
+void amqp_set_utf8_validation(amqp_connection_state_t state, amqp_boolean_t validate) {
+  int flags = state->decoding_pool.flags & ~AMQP_POOL_VALIDATE_UTF8;
+  amqp_pool_set_flags(&state->decoding_pool, validate ? flags | AMQP_POOL_VALIDATE_UTF8 : flags);
+}
+
+/* Where the connection's record of the socket buffer at bytes is, or would go. */
+static amqp_shared_sock_buffer_t **find_shared_sock_buffer(amqp_connection_state_t state,
+							   void const *bytes)
+{
+  amqp_shared_sock_buffer_t **link = &state->shared_sock_buffers;
+
+  while (*link != NULL && (*link)->bytes.bytes != bytes) {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+static void release_shared_sock_buffer(amqp_shared_sock_buffer_t *shared)
+{
+  if (--shared->refcount == 0) {
+    amqp_cached_free(shared->allocator, shared->bytes.bytes, shared->bytes.len);
+    amqp_free(shared->allocator, shared);
+  }
+}
+
+/*
+ * Gives up a socket buffer the connection is done with. It is left to
+ * the bodies retained from it, if any, and otherwise kept back as the
+ * spare if it is of the current size, or freed.
+ */
+static void drop_sock_buffer(amqp_connection_state_t state, amqp_bytes_t buffer)
+{
+  amqp_shared_sock_buffer_t **link = find_shared_sock_buffer(state, buffer.bytes);
+
+  if (*link != NULL) {
+    amqp_shared_sock_buffer_t *shared = *link;
+    *link = shared->next;
+    release_shared_sock_buffer(shared);
+  } else if (state->spare_sock_buffer.bytes == NULL && buffer.len == state->sock_inbound_buffer.len) {
+    state->spare_sock_buffer = buffer;
+  } else {
+    amqp_cached_free(state->buffer_allocator, buffer.bytes, buffer.len);
+  }
+}
+
+/* Drops the socket buffers retired since the first keep of them were. */
+static void release_sock_buffers(amqp_connection_state_t state, int keep)
+{
+  while (state->num_retired_sock_buffers > keep) {
+    drop_sock_buffer(state, state->retired_sock_buffers[--state->num_retired_sock_buffers]);
+  }
+}
+
+static void free_sock_buffers(amqp_connection_state_t state)
+{
+  drop_sock_buffer(state, state->sock_inbound_buffer);
+  state->sock_inbound_buffer.bytes = NULL;
+  release_sock_buffers(state, 0);
+  amqp_cached_free(state->buffer_allocator, state->spare_sock_buffer.bytes, state->spare_sock_buffer.len);
+  state->spare_sock_buffer.bytes = NULL;
+  state->spare_sock_buffer.len = 0;
+}
+
+/*
+ * The size the socket buffer should have for the next recv: doubled
+ * after a run of reads that filled it, halved after a long run of
+ * small ones, and never too small for the partial frame at its end.
+ */
+static size_t wanted_sock_buffer_size(amqp_connection_state_t state, size_t needed)
+{
+  size_t len = state->sock_inbound_buffer.len;
+
+  if (state->sock_inbound_full_reads >= SOCK_BUFFER_GROW_READS) {
+    len *= 2;
+  } else if (state->sock_inbound_small_reads >= SOCK_BUFFER_SHRINK_READS) {
+    len /= 2;
+  }
+  if (len < MIN_INBOUND_SOCK_BUFFER_SIZE) {
+    len = MIN_INBOUND_SOCK_BUFFER_SIZE;
+  } else if (len > MAX_INBOUND_SOCK_BUFFER_SIZE) {
+    len = MAX_INBOUND_SOCK_BUFFER_SIZE;
+  }
+  while (len < needed) {
+    len *= 2;
+  }
+  return len;
+}
+
+/*
+ * Switches to a new socket buffer of len bytes, carrying the partial
+ * frame at the end of the old one over. A pinned buffer is set aside
+ * until the frames decoded in it are released; see release_sock_buffers.
+ */
+static int replace_sock_buffer(amqp_connection_state_t state, size_t len)
+{
+  size_t leftover = state->sock_inbound_limit - state->sock_inbound_offset;
+  amqp_bytes_t fresh;
+
+  if (state->sock_inbound_pinned
+      && state->num_retired_sock_buffers == state->max_retired_sock_buffers)
+  {
+    int max = state->max_retired_sock_buffers ? state->max_retired_sock_buffers * 2 : 4;
+    amqp_bytes_t *retired = amqp_realloc(state->allocator, state->retired_sock_buffers,
+					 max * sizeof(amqp_bytes_t));
+    if (retired == NULL) {
+      return -ERROR_NO_MEMORY;
+    }
+    state->retired_sock_buffers = retired;
+    state->max_retired_sock_buffers = max;
+  }
+
+  if (state->spare_sock_buffer.bytes != NULL && state->spare_sock_buffer.len == len) {
+    fresh = state->spare_sock_buffer;
+    state->spare_sock_buffer.bytes = NULL;
+    state->spare_sock_buffer.len = 0;
+  } else {
+    fresh.len = len;
+    fresh.bytes = amqp_cached_malloc(state->buffer_allocator, len);
+    if (fresh.bytes == NULL) {
+      return -ERROR_NO_MEMORY;
+    }
+  }
+
+  memcpy(fresh.bytes, (char *) state->sock_inbound_buffer.bytes + state->sock_inbound_offset, leftover);
+
+  if (state->spare_sock_buffer.bytes != NULL && state->spare_sock_buffer.len != len) {
+    amqp_cached_free(state->buffer_allocator, state->spare_sock_buffer.bytes,
+		     state->spare_sock_buffer.len);
+    state->spare_sock_buffer.bytes = NULL;
+    state->spare_sock_buffer.len = 0;
+  }
+  if (state->sock_inbound_pinned) {
+    state->retired_sock_buffers[state->num_retired_sock_buffers++] = state->sock_inbound_buffer;
+    state->sock_inbound_buffer = fresh;
+  } else {
+    amqp_bytes_t old = state->sock_inbound_buffer;
+    state->sock_inbound_buffer = fresh;
+    drop_sock_buffer(state, old);
+  }
+
+  state->sock_inbound_offset = 0;
+  state->sock_inbound_limit = leftover;
+  state->sock_inbound_pinned = 0;
+  state->sock_inbound_full_reads = 0;
+  state->sock_inbound_small_reads = 0;
+  return 0;
+}
+
+/*
+ * Reads more from the socket once everything before the partial
+ * frame (if any) at the end of the socket buffer has been handled,
+ * after flushing any coalesced output.
+ * The partial frame stays where it is and the read goes on after it
+ * as long as the rest of the frame and a decent read fit; otherwise
+ * it is moved to the start of the buffer, or of a new one if frames
+ * were decoded in place in this one or it is to be resized. Returns
+ * the number of bytes read, or a negative error code.
+ */
+int amqp_fill_sock_inbound_buffer(amqp_connection_state_t state)
+{
+  size_t leftover = state->sock_inbound_limit - state->sock_inbound_offset;
+  size_t needed = HEADER_SIZE;
+  size_t len;
+  int pinned;
+  int result;
+
+  /* Whatever is read may well be the answer to frames still waiting
+     to be sent. */
+  result = amqp_flush(state);
+  if (result < 0)
+    return result;
+
+  if (leftover >= HEADER_SIZE) {
+    amqp_bytes_t partial;
+    partial.len = leftover;
+    partial.bytes = (char *) state->sock_inbound_buffer.bytes + state->sock_inbound_offset;
+    needed = d_32_helper(partial, 3) + HEADER_SIZE + FOOTER_SIZE;
+  }
+
+  /* A buffer that retained bodies lie in may be read on into, but
+     not over. */
+  pinned = state->sock_inbound_pinned
+    || *find_shared_sock_buffer(state, state->sock_inbound_buffer.bytes) != NULL;
+
+  if (!pinned && leftover == 0) {
+    state->sock_inbound_offset = 0;
+    state->sock_inbound_limit = 0;
+  }
+
+  len = wanted_sock_buffer_size(state, needed);
+  if (len != state->sock_inbound_buffer.len
+      || state->sock_inbound_offset + needed > len
+      || len - state->sock_inbound_limit < len / 4)
+  {
+    if (pinned || len != state->sock_inbound_buffer.len) {
+      int res = replace_sock_buffer(state, len);
+      if (res < 0)
+	return res;
+    } else {
+      memmove(state->sock_inbound_buffer.bytes,
+	      (char *) state->sock_inbound_buffer.bytes + state->sock_inbound_offset,
+	      leftover);
+      state->sock_inbound_offset = 0;
+      state->sock_inbound_limit = leftover;
+    }
+  }
+
+  result = recv(state->sockfd, (char *) state->sock_inbound_buffer.bytes + state->sock_inbound_limit,
+		len - state->sock_inbound_limit, 0);
+  if (result <= 0) {
+    if (result == 0)
+      return -ERROR_CONNECTION_CLOSED;
+    else
+      return -amqp_socket_error();
+  }
+
+  if ((size_t) result == len - state->sock_inbound_limit) {
+    state->sock_inbound_full_reads++;
+    state->sock_inbound_small_reads = 0;
+  } else if ((size_t) result < len / 8) {
+    state->sock_inbound_small_reads++;
+    state->sock_inbound_full_reads = 0;
+  } else {
+    state->sock_inbound_full_reads = 0;
+    state->sock_inbound_small_reads = 0;
+  }
+  state->sock_inbound_limit += result;
+  return result;
+}
+
+/*
+ * Moves the connection's pools and socket buffers into the memory
+ * mode described by flags (AMQP_MEMORY_*). Call this at most once,
+ * straight after amqp_new_connection; it releases the connection's
+ * buffers like amqp_release_buffers. Modes the system cannot provide
+ * (no huge pages, RLIMIT_MEMLOCK too low, or no mmap at all) are
+ * quietly dropped: the result is the set of flags actually in
+ * effect, or a negative error code, in which case the connection is
+ * left as it was.
+ */
+int amqp_set_memory_mode(amqp_connection_state_t state, int flags)
+{
+  amqp_allocator_t const *allocator = &state->mapped_allocator.allocator;
+  void *sock_inbound_bytes;
+  void *outbound_bytes;
+  void *pending_bytes = NULL;
+
+  ENFORCE_STATE(state, CONNECTION_STATE_IDLE);
+
+  amqp_assert(state->memory_mode == 0,
+	      "Programming error: attempt to amqp_set_memory_mode twice");
+  amqp_assert(state->first_queued_frame == NULL,
+	      "Programming error: attempt to amqp_set_memory_mode while waiting events enqueued");
+
+  if (flags & (AMQP_MEMORY_HUGE_PAGES | AMQP_MEMORY_PREFAULT | AMQP_MEMORY_LOCKED)) {
+    flags |= AMQP_MEMORY_MAPPED;
+  }
+  if (flags == 0
+      || !amqp_mapped_allocator_init(&state->mapped_allocator, state->allocator, flags)) {
+    return 0;
+  }
+
+  sock_inbound_bytes = amqp_malloc(allocator, state->sock_inbound_buffer.len);
+  outbound_bytes = amqp_malloc(allocator, state->outbound_buffer.len);
+  if (state->pending_output.bytes != NULL) {
+    pending_bytes = amqp_malloc(allocator, state->pending_output.len);
+  }
+  if (sock_inbound_bytes == NULL || outbound_bytes == NULL
+      || (state->pending_output.bytes != NULL && pending_bytes == NULL)) {
+    amqp_free(allocator, sock_inbound_bytes);
+    amqp_free(allocator, outbound_bytes);
+    amqp_free(allocator, pending_bytes);
+    amqp_mapped_allocator_destroy(&state->mapped_allocator);
+    return -ERROR_NO_MEMORY;
+  }
+
+  memcpy(sock_inbound_bytes, state->sock_inbound_buffer.bytes, state->sock_inbound_limit);
+  free_sock_buffers(state);
+  state->sock_inbound_pinned = 0;
+  amqp_cached_free(state->buffer_allocator, state->outbound_buffer.bytes, state->outbound_buffer.len);
+  state->sock_inbound_buffer.bytes = sock_inbound_bytes;
+  state->outbound_buffer.bytes = outbound_bytes;
+  if (pending_bytes != NULL) {
+    memcpy(pending_bytes, state->pending_output.bytes, state->pending_output_len);
+    amqp_free(state->buffer_allocator, state->pending_output.bytes);
+    state->pending_output.bytes = pending_bytes;
+  }
+
+  state->buffer_allocator = allocator;
+  state->memory_mode = flags;
+  reset_pool(state, &state->frame_pool, state->frame_pool.pagesize);
+  reset_pool(state, &state->decoding_pool, state->decoding_pool.pagesize);
+
+  if (flags & AMQP_MEMORY_PREFAULT) {
+    amqp_pool_reserve(&state->frame_pool, PREFAULT_FRAME_POOL_PAGES);
+    amqp_pool_reserve(&state->decoding_pool, PREFAULT_DECODING_POOL_PAGES);
+  }
+
+  return amqp_get_memory_mode(state);
+}
+
+/* The memory mode flags honoured by every mapping made so far. */
+int amqp_get_memory_mode(amqp_connection_state_t state) {
+  return state->memory_mode ? state->mapped_allocator.achieved : 0;
+}
+
 int amqp_destroy_connection(amqp_connection_state_t state) {
   int s = state->sockfd;
+  amqp_allocator_t const *allocator = state->allocator;
+  amqp_buffer_t *buffer;
+
+  for (buffer = state->retained_buffers; buffer != NULL; buffer = buffer->next) {
+    buffer->state = NULL;
+  }
+  while (state->spare_buffers != NULL) {
+    buffer = state->spare_buffers;
+    state->spare_buffers = buffer->next;
+    amqp_free(allocator, buffer);
+  }
 
   empty_amqp_pool(&state->frame_pool);
   empty_amqp_pool(&state->decoding_pool);
-  free(state->outbound_buffer.bytes);
-  free(state->sock_inbound_buffer.bytes);
-  free(state);
+  amqp_cached_free(state->buffer_allocator, state->outbound_buffer.bytes, state->outbound_buffer.len);
+  free_sock_buffers(state);
+  amqp_free(allocator, state->retired_sock_buffers);
+  amqp_free(state->buffer_allocator, state->pending_output.bytes);
+  if (state->memory_mode) {
+    amqp_mapped_allocator_destroy(&state->mapped_allocator);
+  }
+  amqp_free(allocator, state);
 
   if (s >= 0 && amqp_socket_close(s) < 0)
     return -amqp_socket_error();
@@ -173,6 +603,15 @@ int amqp_destroy_connection(amqp_connection_state_t state) {
     return 0;
 }
 
+void amqp_get_memory_stats(amqp_connection_state_t state,
+			   amqp_memory_stats_t *stats)
+{
+  amqp_pool_get_stats(&state->frame_pool, &stats->frame_pool);
+  amqp_pool_get_stats(&state->decoding_pool, &stats->decoding_pool);
+  stats->sock_inbound_buffer_size = state->sock_inbound_buffer.len;
+  stats->outbound_buffer_size = state->outbound_buffer.len;
+}
+
 static void return_to_idle(amqp_connection_state_t state) {
   state->inbound_buffer.bytes = NULL;
   state->inbound_offset = 0;
@@ -180,21 +619,146 @@ static void return_to_idle(amqp_connection_state_t state) {
   state->state = CONNECTION_STATE_IDLE;
 }
 
-int amqp_handle_input(amqp_connection_state_t state,
-		      amqp_bytes_t received_data,
-		      amqp_frame_t *decoded_frame)
+/*
+ * Decodes a complete frame of frame_size bytes, header and footer
+ * included, lying at the start of buffer. The frame's fields point
+ * into buffer.
+ */
+static int decode_frame(amqp_connection_state_t state,
+			amqp_bytes_t buffer,
+			size_t frame_size,
+			amqp_frame_t *decoded_frame)
 {
-  int total_bytes_consumed = 0;
-  int bytes_consumed;
+  int result = OK;
+  int frame_type = d_8_helper(buffer, 0);
+
+#if 0
+  printf("recving:\n");
+  amqp_dump(buffer.bytes, frame_size);
+#endif
+
+  /* Check frame end marker (footer) */
+  if (d_8_helper(buffer, frame_size - 1) != AMQP_FRAME_END) {
+    return -ERROR_BAD_AMQP_DATA;
+  }
+
+  decoded_frame->channel = d_16_helper(buffer, 1);
+
+  switch (frame_type) {
+    case AMQP_FRAME_METHOD: {
+      amqp_bytes_t encoded;
+
+      /* Four bytes of method ID before the method args. */
+      if (frame_size < HEADER_SIZE + 4 + FOOTER_SIZE) {
+	return -ERROR_BAD_AMQP_DATA;
+      }
+      encoded.len = frame_size - (HEADER_SIZE + 4 + FOOTER_SIZE);
+      encoded.bytes = buf_at(buffer, HEADER_SIZE + 4);
+
+      decoded_frame->frame_type = AMQP_FRAME_METHOD;
+      decoded_frame->payload.method.id = d_32_helper(buffer, HEADER_SIZE);
+      result = amqp_decode_method(decoded_frame->payload.method.id,
+				  &state->decoding_pool,
+				  encoded,
+				  &decoded_frame->payload.method.decoded);
+      if( result < 0 )
+	    return result;
+      break;
+    }
+
+    case AMQP_FRAME_HEADER: {
+      amqp_bytes_t encoded;
+
+      /* 12 bytes for properties header. */
+      if (frame_size < HEADER_SIZE + 12 + FOOTER_SIZE) {
+	return -ERROR_BAD_AMQP_DATA;
+      }
+      encoded.len = frame_size - (HEADER_SIZE + 12 + FOOTER_SIZE);
+      encoded.bytes = buf_at(buffer, HEADER_SIZE + 12);
+
+      decoded_frame->frame_type = AMQP_FRAME_HEADER;
+      decoded_frame->payload.properties.class_id = d_16_helper(buffer, HEADER_SIZE);
+      decoded_frame->payload.properties.body_size = d_64_helper(buffer, HEADER_SIZE+4);
+      decoded_frame->payload.properties.raw = encoded;
+      result = amqp_decode_properties(decoded_frame->payload.properties.class_id,
+				      &state->decoding_pool,
+				      encoded,
+				      &decoded_frame->payload.properties.decoded);
+      if( result < 0 )
+	    return result;
+      break;
+    }
+
+    case AMQP_FRAME_BODY: {
+      size_t fragment_len = frame_size - (HEADER_SIZE + FOOTER_SIZE);
+
+      decoded_frame->frame_type = AMQP_FRAME_BODY;
+      decoded_frame->payload.body_fragment.len = fragment_len;
+      decoded_frame->payload.body_fragment.bytes = buf_at(buffer, HEADER_SIZE);
+      break;
+    }
+
+    case AMQP_FRAME_HEARTBEAT:
+      decoded_frame->frame_type = AMQP_FRAME_HEARTBEAT;
+      break;
+
+    default:
+      /* Ignore the frame by not changing frame_type away from 0. */
+      break;
+  }
+
+  return OK;
+}
+
+/*
+ * With in_place set, a frame that lies whole in received_data is
+ * decoded right there instead of being copied into the frame pool
+ * first, and points into received_data from then on. The start of a
+ * frame is not consumed at all: 0 is returned until all of the frame
+ * has arrived.
+ */
+static int handle_input(amqp_connection_state_t state,
+			amqp_bytes_t received_data,
+			amqp_frame_t *decoded_frame,
+			int in_place)
+{
+  size_t total_bytes_consumed = 0;
+  size_t bytes_consumed;
   int result = OK;
 
   /* Returning frame_type of zero indicates either insufficient input,
      or a complete, ignored frame was read. */
   decoded_frame->frame_type = 0;
 
+  if (in_place && state->state == CONNECTION_STATE_IDLE && received_data.len < HEADER_SIZE) {
+    return 0;
+  }
+
+  if (in_place && state->state == CONNECTION_STATE_IDLE
+      && !(d_8_helper(received_data, 0) == AMQP_PSEUDOFRAME_PROTOCOL_HEADER &&
+	   d_16_helper(received_data, 1) == AMQP_PSEUDOFRAME_PROTOCOL_CHANNEL))
+  {
+    uint32_t payload_len = d_32_helper(received_data, 3);
+
+    if (payload_len > state->inbound_buffer.len - (HEADER_SIZE + FOOTER_SIZE)) {
+      return -ERROR_BAD_AMQP_DATA;
+    }
+    bytes_consumed = payload_len + HEADER_SIZE + FOOTER_SIZE;
+    if (received_data.len >= bytes_consumed) {
+      result = decode_frame(state, received_data, bytes_consumed, decoded_frame);
+      if (result < 0)
+	return result;
+      if (decoded_frame->frame_type != 0 && decoded_frame->frame_type != AMQP_FRAME_HEARTBEAT) {
+	state->sock_inbound_pinned = 1;
+      }
+      return (int) bytes_consumed;
+    }
+    return 0;
+  }
+
  read_more:
   if (received_data.len == 0) {
-    return total_bytes_consumed;
+    return (int) total_bytes_consumed;
   }
 
   if (state->state == CONNECTION_STATE_IDLE) {
@@ -213,25 +777,33 @@ int amqp_handle_input(amqp_connection_state_t state,
     bytes_consumed = received_data.len;
   }
 
-  amqp_ebytes(state->inbound_buffer, state->inbound_offset, bytes_consumed, received_data.bytes);
+  /* target_size never exceeds the buffer; see below. */
+  memcpy((char *) state->inbound_buffer.bytes + state->inbound_offset, received_data.bytes, bytes_consumed);
   state->inbound_offset += bytes_consumed;
   total_bytes_consumed += bytes_consumed;
 
   assert(state->inbound_offset <= state->target_size);
 
   if (state->inbound_offset < state->target_size) {
-    return total_bytes_consumed;
+    return (int) total_bytes_consumed;
   }
 
   switch (state->state) {
     case CONNECTION_STATE_WAITING_FOR_HEADER:
-      if (amqp_d8(state->inbound_buffer, 0) == AMQP_PSEUDOFRAME_PROTOCOL_HEADER &&
-	  amqp_d16(state->inbound_buffer, 1) == AMQP_PSEUDOFRAME_PROTOCOL_CHANNEL)
+      if (d_8_helper(state->inbound_buffer, 0) == AMQP_PSEUDOFRAME_PROTOCOL_HEADER &&
+	  d_16_helper(state->inbound_buffer, 1) == AMQP_PSEUDOFRAME_PROTOCOL_CHANNEL)
       {
 	state->target_size = 8;
 	state->state = CONNECTION_STATE_WAITING_FOR_PROTOCOL_HEADER;
       } else {
-	state->target_size = amqp_d32(state->inbound_buffer, 3) + HEADER_SIZE + FOOTER_SIZE;
+	uint32_t payload_len = d_32_helper(state->inbound_buffer, 3);
+
+	/* The one bounds check for the whole frame: everything below
+	   reads within target_size bytes of the buffer unchecked. */
+	if (payload_len > state->inbound_buffer.len - (HEADER_SIZE + FOOTER_SIZE)) {
+	  return -ERROR_BAD_AMQP_DATA;
+	}
+	state->target_size = payload_len + HEADER_SIZE + FOOTER_SIZE;
 	state->state = CONNECTION_STATE_WAITING_FOR_BODY;
       }
 
@@ -240,95 +812,26 @@ int amqp_handle_input(amqp_connection_state_t state,
       received_data.bytes = ((char *) received_data.bytes) + bytes_consumed;
       goto read_more;
 
-    case CONNECTION_STATE_WAITING_FOR_BODY: {
-      int frame_type = amqp_d8(state->inbound_buffer, 0);
-
-#if 0
-      printf("recving:\n");
-      amqp_dump(state->inbound_buffer.bytes, state->target_size);
-#endif
-
-      /* Check frame end marker (footer) */
-      if (amqp_d8(state->inbound_buffer, state->target_size - 1) != AMQP_FRAME_END) {
-	    return -ERROR_BAD_AMQP_DATA;
-      }
-
-      decoded_frame->channel = amqp_d16(state->inbound_buffer, 1);
-
-      switch (frame_type) {
-	case AMQP_FRAME_METHOD: {
-	  amqp_bytes_t encoded;
-
-	  /* Four bytes of method ID before the method args. */
-	  encoded.len = state->target_size - (HEADER_SIZE + 4 + FOOTER_SIZE);
-	  encoded.bytes = amqp_dbytes(state->inbound_buffer, HEADER_SIZE + 4, encoded.len);
-
-	  decoded_frame->frame_type = AMQP_FRAME_METHOD;
-	  decoded_frame->payload.method.id = amqp_d32(state->inbound_buffer, HEADER_SIZE);
-	  result = amqp_decode_method(decoded_frame->payload.method.id,
-					       &state->decoding_pool,
-					       encoded,
-					       &decoded_frame->payload.method.decoded);
-	  if( result < 0 )
-		return result;
-	  break;
-	}
-
-	case AMQP_FRAME_HEADER: {
-	  amqp_bytes_t encoded;
-
-	  /* 12 bytes for properties header. */
-	  encoded.len = state->target_size - (HEADER_SIZE + 12 + FOOTER_SIZE);
-	  encoded.bytes = amqp_dbytes(state->inbound_buffer, HEADER_SIZE + 12, encoded.len);
-
-	  decoded_frame->frame_type = AMQP_FRAME_HEADER;
-	  decoded_frame->payload.properties.class_id = amqp_d16(state->inbound_buffer, HEADER_SIZE);
-	  decoded_frame->payload.properties.body_size = amqp_d64(state->inbound_buffer, HEADER_SIZE+4);
-	  decoded_frame->payload.properties.raw = encoded;
-	  result = amqp_decode_properties(decoded_frame->payload.properties.class_id,
-						   &state->decoding_pool,
-						   encoded,
-						   &decoded_frame->payload.properties.decoded);
-	  if( result < 0 )
-		return result;
-	  break;
-	}
-
-	case AMQP_FRAME_BODY: {
-	  size_t fragment_len = state->target_size - (HEADER_SIZE + FOOTER_SIZE);
-
-	  decoded_frame->frame_type = AMQP_FRAME_BODY;
-	  decoded_frame->payload.body_fragment.len = fragment_len;
-	  decoded_frame->payload.body_fragment.bytes =
-	    amqp_dbytes(state->inbound_buffer, HEADER_SIZE, fragment_len);
-	  break;
-	}
-
-	case AMQP_FRAME_HEARTBEAT:
-	  decoded_frame->frame_type = AMQP_FRAME_HEARTBEAT;
-	  break;
-
-	default:
-	  /* Ignore the frame by not changing frame_type away from 0. */
-	  break;
-      }
+    case CONNECTION_STATE_WAITING_FOR_BODY:
+      result = decode_frame(state, state->inbound_buffer, state->target_size, decoded_frame);
+      if (result < 0)
+	return result;
 
       return_to_idle(state);
-      return total_bytes_consumed;
-    }
+      return (int) total_bytes_consumed;
 
     case CONNECTION_STATE_WAITING_FOR_PROTOCOL_HEADER:
       decoded_frame->frame_type = AMQP_PSEUDOFRAME_PROTOCOL_HEADER;
       decoded_frame->channel = AMQP_PSEUDOFRAME_PROTOCOL_CHANNEL;
-      amqp_assert(amqp_d8(state->inbound_buffer, 3) == (uint8_t) 'P',
+      amqp_assert(d_8_helper(state->inbound_buffer, 3) == (uint8_t) 'P',
 		  "Invalid protocol header received");
-      decoded_frame->payload.protocol_header.transport_high = amqp_d8(state->inbound_buffer, 4);
-      decoded_frame->payload.protocol_header.transport_low = amqp_d8(state->inbound_buffer, 5);
-      decoded_frame->payload.protocol_header.protocol_version_major = amqp_d8(state->inbound_buffer, 6);
-      decoded_frame->payload.protocol_header.protocol_version_minor = amqp_d8(state->inbound_buffer, 7);
+      decoded_frame->payload.protocol_header.transport_high = d_8_helper(state->inbound_buffer, 4);
+      decoded_frame->payload.protocol_header.transport_low = d_8_helper(state->inbound_buffer, 5);
+      decoded_frame->payload.protocol_header.protocol_version_major = d_8_helper(state->inbound_buffer, 6);
+      decoded_frame->payload.protocol_header.protocol_version_minor = d_8_helper(state->inbound_buffer, 7);
 
       return_to_idle(state);
-      return total_bytes_consumed;
+      return (int) total_bytes_consumed;
 
     default:
       amqp_assert(0, "Internal error: invalid amqp_connection_state_t->state %d", state->state);
@@ -336,6 +839,35 @@ int amqp_handle_input(amqp_connection_state_t state,
   }
 }
 
+int amqp_handle_input(amqp_connection_state_t state,
+		      amqp_bytes_t received_data,
+		      amqp_frame_t *decoded_frame)
+{
+  return amqp_connection_error(state, handle_input(state, received_data, decoded_frame, 0));
+}
+
+/*
+ * amqp_handle_input on what is left in the socket buffer, decoding
+ * whole frames in place; a frame decoded there pins the buffer.
+ * Returns 0 if the buffer ends in a partial frame and more must be
+ * read; see amqp_fill_sock_inbound_buffer.
+ */
+int amqp_handle_sock_input(amqp_connection_state_t state,
+			   amqp_frame_t *decoded_frame)
+{
+  amqp_bytes_t buffer;
+  int result;
+
+  buffer.len = state->sock_inbound_limit - state->sock_inbound_offset;
+  buffer.bytes = (char *) state->sock_inbound_buffer.bytes + state->sock_inbound_offset;
+  result = handle_input(state, buffer, decoded_frame, 1);
+  if (result < 0)
+    return amqp_connection_error(state, result);
+
+  state->sock_inbound_offset += result;
+  return result;
+}
+
 amqp_boolean_t amqp_release_buffers_ok(amqp_connection_state_t state) {
   return (state->state == CONNECTION_STATE_IDLE) && (state->first_queued_frame == NULL);
 }
@@ -348,6 +880,8 @@ void amqp_release_buffers(amqp_connection_state_t state) {
 
   recycle_amqp_pool(&state->frame_pool);
   recycle_amqp_pool(&state->decoding_pool);
+  release_sock_buffers(state, 0);
+  state->sock_inbound_pinned = 0;
 }
 
 void amqp_maybe_release_buffers(amqp_connection_state_t state) {
@@ -356,51 +890,302 @@ void amqp_maybe_release_buffers(amqp_connection_state_t state) {
   }
 }
 
+/*
+ * Keeps the body fragment of a frame returned by amqp_handle_input or
+ * amqp_simple_wait_frame valid past amqp_release_buffers and the
+ * like, without copying it: the frame pool gives up the memory the
+ * frame was read into, or, for a frame decoded in place, the socket
+ * buffer is shared with the retained body and not reused. Must be
+ * called before the frame's buffers are released; bodies found in
+ * neither, or that live in memory set up by amqp_set_memory_mode,
+ * are copied instead.
+ * Returns NULL if out of memory. Buffers are not thread-safe: retain
+ * and release them on the connection's thread, or any thread once the
+ * connection has been destroyed.
+ */
+/*
+ * Takes a reference to the socket buffer, current or retired, that
+ * bytes lie in, or returns NULL if they are in none.
+ */
+static amqp_shared_sock_buffer_t *share_sock_buffer(amqp_connection_state_t state,
+						    void const *bytes)
+{
+  amqp_bytes_t buffer = state->sock_inbound_buffer;
+  amqp_shared_sock_buffer_t **link;
+  int i = state->num_retired_sock_buffers;
+
+  while ((char const *) bytes < (char const *) buffer.bytes
+	 || (char const *) bytes >= (char const *) buffer.bytes + buffer.len)
+  {
+    if (i == 0) {
+      return NULL;
+    }
+    buffer = state->retired_sock_buffers[--i];
+  }
+
+  link = find_shared_sock_buffer(state, buffer.bytes);
+  if (*link == NULL) {
+    *link = amqp_malloc(state->buffer_allocator, sizeof(amqp_shared_sock_buffer_t));
+    if (*link == NULL) {
+      return NULL;
+    }
+    (*link)->refcount = 1; /* the connection's */
+    (*link)->bytes = buffer;
+    (*link)->allocator = state->buffer_allocator;
+    (*link)->next = NULL;
+  }
+  (*link)->refcount++;
+  return *link;
+}
+
+amqp_buffer_t *amqp_retain_body(amqp_connection_state_t state,
+				amqp_frame_t const *frame)
+{
+  amqp_bytes_t body = frame->payload.body_fragment;
+  amqp_buffer_t *buffer;
+
+  amqp_assert(frame->frame_type == AMQP_FRAME_BODY,
+	      "Programming error: attempt to amqp_retain_body of a frame of type %d",
+	      frame->frame_type);
+
+  buffer = state->spare_buffers;
+  if (buffer != NULL) {
+    state->spare_buffers = buffer->next;
+  } else {
+    buffer = amqp_malloc(state->allocator, sizeof(amqp_buffer_t));
+    if (buffer == NULL) {
+      return NULL;
+    }
+  }
+
+  buffer->pooled = 0;
+  buffer->sock_buffer = NULL;
+  buffer->copy = NULL;
+  if (state->memory_mode == 0
+      && amqp_pool_detach(&state->frame_pool, (char *) body.bytes - HEADER_SIZE, &buffer->detached))
+  {
+    buffer->pooled = 1;
+  } else if (state->memory_mode == 0
+	     && (buffer->sock_buffer = share_sock_buffer(state, body.bytes)) != NULL)
+  {
+    /* It stays where it was decoded. */
+  } else {
+    buffer->copy = amqp_malloc(state->allocator, body.len ? body.len : 1);
+    if (buffer->copy == NULL) {
+      buffer->next = state->spare_buffers;
+      state->spare_buffers = buffer;
+      return NULL;
+    }
+    memcpy(buffer->copy, body.bytes, body.len);
+    body.bytes = buffer->copy;
+  }
+
+  buffer->refcount = 1;
+  buffer->bytes = body;
+  buffer->allocator = state->allocator;
+  buffer->state = state;
+  buffer->prev = NULL;
+  buffer->next = state->retained_buffers;
+  if (buffer->next != NULL) {
+    buffer->next->prev = buffer;
+  }
+  state->retained_buffers = buffer;
+
+  return buffer;
+}
+
+amqp_bytes_t amqp_buffer_bytes(amqp_buffer_t const *buffer) {
+  return buffer->bytes;
+}
+
+void amqp_buffer_retain(amqp_buffer_t *buffer) {
+  buffer->refcount++;
+}
+
+/*
+ * Drops a reference; the last one gives the memory back to the
+ * connection's frame pool for reuse.
+ */
+void amqp_buffer_release(amqp_buffer_t *buffer) {
+  amqp_connection_state_t state = buffer->state;
+
+  if (--buffer->refcount > 0) {
+    return;
+  }
+
+  if (state == NULL) {
+    if (buffer->pooled) {
+      amqp_pool_free_detached(&buffer->detached);
+    } else if (buffer->sock_buffer != NULL) {
+      release_shared_sock_buffer(buffer->sock_buffer);
+    } else {
+      amqp_free(buffer->allocator, buffer->copy);
+    }
+    amqp_free(buffer->allocator, buffer);
+    return;
+  }
+
+  if (buffer->prev != NULL) {
+    buffer->prev->next = buffer->next;
+  } else {
+    state->retained_buffers = buffer->next;
+  }
+  if (buffer->next != NULL) {
+    buffer->next->prev = buffer->prev;
+  }
+
+  if (buffer->pooled) {
+    amqp_pool_reattach(&state->frame_pool, &buffer->detached);
+  } else if (buffer->sock_buffer != NULL) {
+    release_shared_sock_buffer(buffer->sock_buffer);
+  } else {
+    amqp_free(buffer->allocator, buffer->copy);
+  }
+
+  buffer->next = state->spare_buffers;
+  state->spare_buffers = buffer;
+}
+
+/*
+ * Marks the connection's buffers, so that the frames received from
+ * here on (a delivery, say) can be freed with amqp_rewind_buffers
+ * while frames queued earlier stay valid.
+ */
+void amqp_mark_buffers(amqp_connection_state_t state,
+		       amqp_buffers_mark_t *mark)
+{
+  ENFORCE_STATE(state, CONNECTION_STATE_IDLE);
+
+  amqp_pool_mark(&state->frame_pool, &mark->frame_pool);
+  amqp_pool_mark(&state->decoding_pool, &mark->decoding_pool);
+  mark->last_queued_frame = state->last_queued_frame;
+  mark->num_retired_sock_buffers = state->num_retired_sock_buffers;
+  mark->sock_inbound_pinned = state->sock_inbound_pinned;
+}
+
+/*
+ * Rewinding is safe between frames, as long as no frame received
+ * since the mark is still waiting in the queue.
+ */
+amqp_boolean_t amqp_rewind_buffers_ok(amqp_connection_state_t state,
+				      amqp_buffers_mark_t const *mark)
+{
+  return (state->state == CONNECTION_STATE_IDLE)
+    && (state->first_queued_frame == NULL
+	|| state->last_queued_frame == mark->last_queued_frame);
+}
+
+void amqp_rewind_buffers(amqp_connection_state_t state,
+			 amqp_buffers_mark_t const *mark)
+{
+  ENFORCE_STATE(state, CONNECTION_STATE_IDLE);
+
+  amqp_assert(amqp_rewind_buffers_ok(state, mark),
+	      "Programming error: attempt to amqp_rewind_buffers past waiting events enqueued");
+
+  amqp_pool_rewind(&state->frame_pool, &mark->frame_pool);
+  amqp_pool_rewind(&state->decoding_pool, &mark->decoding_pool);
+
+  /* Socket buffers are only still pinned by frames from before the
+     mark, and only the one in use at the mark can be. */
+  if (state->num_retired_sock_buffers == mark->num_retired_sock_buffers) {
+    state->sock_inbound_pinned = mark->sock_inbound_pinned;
+  } else {
+    release_sock_buffers(state, mark->num_retired_sock_buffers + (mark->sock_inbound_pinned ? 1 : 0));
+    state->sock_inbound_pinned = 0;
+  }
+}
+
+#define SEND_FRAME_NO_ROOM 2
+
+/* The most iovecs handed to one writev when sending messages. */
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define SEND_FRAMES_MAX_IOV IOV_MAX
+#else
+#define SEND_FRAMES_MAX_IOV 1024
+#endif
+
+/*
+ * Encodes frame into the outbound buffer at offset. Returns 0 if the
+ * whole frame is there, 1 if only its header is, with the frame end
+ * byte right after it, and the payload is left in *encoded (body
+ * frames), or SEND_FRAME_NO_ROOM if the frame does not fit after
+ * offset, though it would at the start of the buffer.
+ */
 static int inner_send_frame(amqp_connection_state_t state,
 			    amqp_frame_t const *frame,
+			    size_t offset,
 			    amqp_bytes_t *encoded,
-			    int *payload_len)
+			    size_t *payload_len)
 {
   int           separate_body = 0;
   amqp_bytes_t  bytes;
+  amqp_bytes_t  out;
   int64_t       result        = OK;
 
   bytes.bytes = NULL;
   bytes.len   = 0;
 
-  amqp_e8(state->outbound_buffer, 0, frame->frame_type);
-  amqp_e16(state->outbound_buffer, 1, frame->channel);
+  /* The outbound buffer is frame_max bytes long, at least
+     AMQP_FRAME_MIN_SIZE, so the fixed-size frame and content headers
+     always fit. What follows them is sized before it is encoded, so
+     that a frame too big for frame_max fails up front. */
+  if (offset + HEADER_SIZE + 12 + FOOTER_SIZE > state->outbound_buffer.len)
+    return SEND_FRAME_NO_ROOM;
+  out.bytes = buf_at(state->outbound_buffer, offset);
+  out.len = state->outbound_buffer.len - offset;
+
+  e_8_helper(out, 0, frame->frame_type);
+  e_16_helper(out, 1, frame->channel);
 
   switch (frame->frame_type) {
     case AMQP_FRAME_METHOD:
-      amqp_e32(state->outbound_buffer, HEADER_SIZE, frame->payload.method.id);
-      encoded->len = state->outbound_buffer.len - (HEADER_SIZE + 4 + FOOTER_SIZE);
-      encoded->bytes = amqp_dbytes(state->outbound_buffer, HEADER_SIZE + 4, encoded->len);
+      result = amqp_encoded_method_size(frame->payload.method.id,
+					frame->payload.method.decoded);
+      if( result < 0 )
+	return result;
+      if ((size_t) result > state->outbound_buffer.len - (HEADER_SIZE + 4 + FOOTER_SIZE))
+	return -ERROR_FRAME_TOO_LARGE;
+      if ((size_t) result > out.len - (HEADER_SIZE + 4 + FOOTER_SIZE))
+	return SEND_FRAME_NO_ROOM;
+      e_32_helper(out, HEADER_SIZE, frame->payload.method.id);
+      encoded->len = out.len - (HEADER_SIZE + 4 + FOOTER_SIZE);
+      encoded->bytes = buf_at(out, HEADER_SIZE + 4);
       result = amqp_encode_method(frame->payload.method.id,
 			  frame->payload.method.decoded,
 			  *encoded);
       if( result < 0 )
     	return result;
-      *payload_len = (int) result + 4;
+      *payload_len = (size_t) result + 4;
       separate_body = 0;
       break;
 
     case AMQP_FRAME_HEADER:
-      amqp_e16(state->outbound_buffer, HEADER_SIZE, frame->payload.properties.class_id);
-      amqp_e32(state->outbound_buffer, HEADER_SIZE+2, 0); /* "weight" */
-      amqp_e64(state->outbound_buffer, HEADER_SIZE+4, frame->payload.properties.body_size);
-      encoded->len = state->outbound_buffer.len - (HEADER_SIZE + 12 + FOOTER_SIZE);
-      encoded->bytes = amqp_dbytes(state->outbound_buffer, HEADER_SIZE + 12, encoded->len);
+      result = amqp_encoded_properties_size(frame->payload.properties.class_id,
+					    frame->payload.properties.decoded);
+      if( result < 0 )
+	return result;
+      if ((size_t) result > state->outbound_buffer.len - (HEADER_SIZE + 12 + FOOTER_SIZE))
+	return -ERROR_FRAME_TOO_LARGE;
+      if ((size_t) result > out.len - (HEADER_SIZE + 12 + FOOTER_SIZE))
+	return SEND_FRAME_NO_ROOM;
+      e_16_helper(out, HEADER_SIZE, frame->payload.properties.class_id);
+      e_16_helper(out, HEADER_SIZE+2, 0); /* "weight" */
+      e_64_helper(out, HEADER_SIZE+4, frame->payload.properties.body_size);
+      encoded->len = out.len - (HEADER_SIZE + 12 + FOOTER_SIZE);
+      encoded->bytes = buf_at(out, HEADER_SIZE + 12);
       result = amqp_encode_properties(frame->payload.properties.class_id,
 		      frame->payload.properties.decoded,
 		      *encoded);
       if( result < 0 )
     	return result;
-      *payload_len = (int) result + 12;
+      *payload_len = (size_t) result + 12;
       separate_body = 0;
       break;
 
     case AMQP_FRAME_BODY:
+      if (frame->payload.body_fragment.len > state->outbound_buffer.len - (HEADER_SIZE + FOOTER_SIZE))
+	return -ERROR_FRAME_TOO_LARGE;
       *encoded = frame->payload.body_fragment;
       *payload_len = encoded->len;
       separate_body = 1;
@@ -418,61 +1203,497 @@ static int inner_send_frame(amqp_connection_state_t state,
       abort();
   }
 
-  amqp_e32(state->outbound_buffer, 3, *payload_len);
-  if (!separate_body) {
-    amqp_e8(state->outbound_buffer, *payload_len + HEADER_SIZE, AMQP_FRAME_END);
-  }
+  e_32_helper(out, 3, (uint32_t) *payload_len);
+  e_8_helper(out, separate_body ? HEADER_SIZE : *payload_len + HEADER_SIZE, AMQP_FRAME_END);
 
 #if 0
   if (separate_body) {
     printf("sending body frame (header):\n");
-    amqp_dump(state->outbound_buffer.bytes, HEADER_SIZE);
+    amqp_dump(out.bytes, HEADER_SIZE);
     printf("sending body frame (payload):\n");
     amqp_dump(encoded->bytes, *payload_len);
   } else {
     printf("sending:\n");
-    amqp_dump(state->outbound_buffer.bytes, *payload_len + HEADER_SIZE + FOOTER_SIZE);
+    amqp_dump(out.bytes, *payload_len + HEADER_SIZE + FOOTER_SIZE);
   }
 #endif
 
   return separate_body;
 }
 
+/* Writes all of iov, however many calls it takes. */
+static int write_iov(amqp_connection_state_t state, struct iovec *iov, int nvecs)
+{
+  while (nvecs > 0) {
+    int res = amqp_socket_writev(state->sockfd, iov, nvecs);
+    if (res < 0)
+      return -amqp_socket_error();
+
+    while (nvecs > 0 && (size_t) res >= iov->iov_len) {
+      res -= iov->iov_len;
+      iov++;
+      nvecs--;
+    }
+    if (nvecs > 0) {
+      iov->iov_base = (char *) iov->iov_base + res;
+      iov->iov_len -= res;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Sends whatever frames are waiting in the coalescing buffer; see
+ * amqp_set_write_coalescing.
+ */
+int amqp_flush(amqp_connection_state_t state)
+{
+  struct iovec iov;
+  int res;
+
+  if (state->pending_output_len == 0)
+    return 0;
+
+  iov.iov_base = state->pending_output.bytes;
+  iov.iov_len = state->pending_output_len;
+  state->pending_output_len = 0;
+  res = write_iov(state, &iov, 1);
+  return amqp_connection_error(state, res);
+}
+
+/* Flushes the coalescing buffer if its oldest frame is past the delay. */
+int amqp_flush_if_due(amqp_connection_state_t state)
+{
+  if (state->pending_output_len > 0 && state->flush_delay_usec > 0
+      && amqp_monotonic_usec() - state->pending_output_since >= (uint64_t) state->flush_delay_usec)
+  {
+    return amqp_flush(state);
+  }
+  return 0;
+}
+
+/*
+ * Makes amqp_send_frame collect frames in a buffer of max_bytes and
+ * send them together: when the buffer fills up, when a frame does
+ * not fit (the two go out in a single writev), when the oldest frame
+ * has waited max_delay_usec microseconds by the time another frame is
+ * sent or a wait function is called, before reading from the socket,
+ * and on amqp_flush. A max_delay_usec of 0 sets no deadline; a
+ * max_bytes of 0 turns coalescing off again. Frames already waiting
+ * are flushed first. Returns 0 or a negative error code.
+ */
+int amqp_set_write_coalescing(amqp_connection_state_t state,
+			      size_t max_bytes,
+			      int max_delay_usec)
+{
+  void *bytes = NULL;
+  int res;
+
+  res = amqp_flush(state);
+  if (res < 0)
+    return res;
+
+  if (max_bytes != state->pending_output.len) {
+    if (max_bytes > 0) {
+      bytes = amqp_malloc(state->buffer_allocator, max_bytes);
+      if (bytes == NULL)
+	return -ERROR_NO_MEMORY;
+    }
+    amqp_free(state->buffer_allocator, state->pending_output.bytes);
+    state->pending_output.bytes = bytes;
+    state->pending_output.len = max_bytes;
+  }
+  state->flush_delay_usec = max_delay_usec;
+  return 0;
+}
+
 int amqp_send_frame(amqp_connection_state_t state,
 		    amqp_frame_t const *frame)
 {
   amqp_bytes_t encoded;
-  int payload_len, res;
-
-  res = inner_send_frame(state, frame, &encoded, &payload_len);
+  size_t payload_len;
+  struct iovec iov[4];
+  struct iovec *frame_iov = &iov[1];
+  char frame_end_byte = AMQP_FRAME_END;
+  int nvecs;
+  int res;
+
+  res = inner_send_frame(state, frame, 0, &encoded, &payload_len);
   switch (res) {
     case 0:
-      res = send(state->sockfd, state->outbound_buffer.bytes,
-		 payload_len + (HEADER_SIZE + FOOTER_SIZE), 0);
+      frame_iov[0].iov_base = state->outbound_buffer.bytes;
+      frame_iov[0].iov_len = payload_len + (HEADER_SIZE + FOOTER_SIZE);
+      nvecs = 1;
       break;
 
-    case 1: {
-      struct iovec iov[3];
-      char frame_end_byte = AMQP_FRAME_END;
-      iov[0].iov_base = state->outbound_buffer.bytes;
-      iov[0].iov_len = HEADER_SIZE;
-      iov[1].iov_base = encoded.bytes;
-      iov[1].iov_len = payload_len;
-      iov[2].iov_base = &frame_end_byte;
+    case 1:
+      frame_iov[0].iov_base = state->outbound_buffer.bytes;
+      frame_iov[0].iov_len = HEADER_SIZE;
+      frame_iov[1].iov_base = encoded.bytes;
+      frame_iov[1].iov_len = payload_len;
+      frame_iov[2].iov_base = &frame_end_byte;
       assert(FOOTER_SIZE == 1);
-      iov[2].iov_len = FOOTER_SIZE;
-      res = amqp_socket_writev(state->sockfd, &iov[0], 3);
+      frame_iov[2].iov_len = FOOTER_SIZE;
+      nvecs = 3;
       break;
-    }
 
     default:
+      return amqp_connection_error(state, res);
+  }
+
+  if (state->pending_output.bytes != NULL) {
+    size_t frame_len = payload_len + (HEADER_SIZE + FOOTER_SIZE);
+
+    if (frame_len <= state->pending_output.len - state->pending_output_len) {
+      int i;
+
+      if (state->pending_output_len == 0)
+	state->pending_output_since = amqp_monotonic_usec();
+      for (i = 0; i < nvecs; i++) {
+	memcpy((char *) state->pending_output.bytes + state->pending_output_len,
+	       frame_iov[i].iov_base, frame_iov[i].iov_len);
+	state->pending_output_len += frame_iov[i].iov_len;
+      }
+
+      if (state->pending_output_len == state->pending_output.len)
+	return amqp_flush(state);
+      return amqp_flush_if_due(state);
+    }
+
+    /* Send the waiting frames and this one together. */
+    if (state->pending_output_len > 0) {
+      iov[0].iov_base = state->pending_output.bytes;
+      iov[0].iov_len = state->pending_output_len;
+      state->pending_output_len = 0;
+      frame_iov = &iov[0];
+      nvecs++;
+    }
+  }
+
+  return amqp_connection_error(state, write_iov(state, frame_iov, nvecs));
+}
+
+/*
+ * Frames being gathered for a single writev: encoded one after
+ * another into the outbound buffer, with body fragments pointed at
+ * where they lie. iov[0] is kept for coalesced output to go first.
+ */
+typedef struct frame_gather_t_ {
+  struct iovec iov[SEND_FRAMES_MAX_IOV + 1];
+  int nvecs; /* from iov[1] on */
+  size_t offset; /* into the outbound buffer */
+  size_t len;
+  int writes; /* successful gather_writes */
+  int error; /* of a failed gather_write */
+  size_t mark; /* len where the current message starts */
+  int split; /* part of that message has been written */
+} frame_gather_t;
+
+static char const frame_end_byte = AMQP_FRAME_END;
+
+static void gather_init(frame_gather_t *g)
+{
+  g->nvecs = 0;
+  g->offset = 0;
+  g->len = 0;
+  g->writes = 0;
+  g->error = 0;
+  g->mark = 0;
+  g->split = 0;
+}
+
+static void gather_bytes(frame_gather_t *g, void const *bytes, size_t len)
+{
+  struct iovec *last = &g->iov[g->nvecs];
+
+  if (g->nvecs > 0 && (char *) last->iov_base + last->iov_len == (char const *) bytes) {
+    last->iov_len += len;
+  } else {
+    last[1].iov_base = (char *) bytes;
+    last[1].iov_len = len;
+    g->nvecs++;
+  }
+  g->len += len;
+}
+
+/*
+ * Writes out what has been gathered, after any coalesced output, or
+ * adds it to the coalesced output if it fits there.
+ */
+static int gather_write(amqp_connection_state_t state, frame_gather_t *g)
+{
+  struct iovec *iov = &g->iov[1];
+  int nvecs = g->nvecs;
+  int res;
+  int i;
+
+  if (nvecs == 0)
+    return 0;
+  g->nvecs = 0;
+  g->offset = 0;
+  if (g->len > g->mark)
+    g->split = 1;
+  g->mark = 0;
+
+  if (state->pending_output.bytes != NULL) {
+    if (g->len <= state->pending_output.len - state->pending_output_len) {
+      if (state->pending_output_len == 0)
+	state->pending_output_since = amqp_monotonic_usec();
+      for (i = 0; i < nvecs; i++) {
+	memcpy((char *) state->pending_output.bytes + state->pending_output_len,
+	       iov[i].iov_base, iov[i].iov_len);
+	state->pending_output_len += iov[i].iov_len;
+      }
+      g->len = 0;
+
+      if (state->pending_output_len == state->pending_output.len)
+	res = amqp_flush(state);
+      else
+	res = amqp_flush_if_due(state);
+      if (res < 0)
+	g->error = res;
+      else
+	g->writes++;
       return res;
+    }
+
+    /* Send the waiting frames and these together. */
+    if (state->pending_output_len > 0) {
+      iov = &g->iov[0];
+      iov->iov_base = state->pending_output.bytes;
+      iov->iov_len = state->pending_output_len;
+      state->pending_output_len = 0;
+      nvecs++;
+    }
   }
 
+  g->len = 0;
+  res = write_iov(state, iov, nvecs);
   if (res < 0)
-    return -amqp_socket_error();
+    g->error = res;
   else
-    return 0;
+    g->writes++;
+  return res;
+}
+
+static int gather_frame(amqp_connection_state_t state,
+			frame_gather_t *g,
+			amqp_frame_t const *frame)
+{
+  amqp_bytes_t encoded;
+  size_t payload_len;
+  char *start;
+  int res;
+
+  while (1) {
+    res = SEND_FRAME_NO_ROOM;
+    if (g->nvecs + 3 <= SEND_FRAMES_MAX_IOV) {
+      res = inner_send_frame(state, frame, g->offset, &encoded, &payload_len);
+      if (res < 0)
+	return res;
+    }
+    if (res != SEND_FRAME_NO_ROOM)
+      break;
+
+    res = gather_write(state, g);
+    if (res < 0)
+      return res;
+  }
+
+  start = (char *) state->outbound_buffer.bytes + g->offset;
+  if (res == 0) {
+    gather_bytes(g, start, payload_len + (HEADER_SIZE + FOOTER_SIZE));
+    g->offset += payload_len + (HEADER_SIZE + FOOTER_SIZE);
+  } else {
+    g->offset += HEADER_SIZE + FOOTER_SIZE;
+    gather_bytes(g, start, HEADER_SIZE);
+    if (payload_len > 0)
+      gather_bytes(g, encoded.bytes, payload_len);
+    gather_bytes(g, start + HEADER_SIZE, FOOTER_SIZE);
+  }
+  return 0;
+}
+
+/*
+ * Gathers body frames carrying the concatenation of num_segments
+ * segments, split at frame_max wherever that falls.
+ */
+static int gather_body(amqp_connection_state_t state,
+		       frame_gather_t *g,
+		       amqp_channel_t channel,
+		       amqp_bytes_t const *segments,
+		       int num_segments)
+{
+  size_t usable_body_payload_size = state->frame_max - (HEADER_SIZE + FOOTER_SIZE);
+  size_t segment_offset = 0;
+  int    res;
+
+  while (1) {
+    size_t frame_len = 0;
+    size_t left;
+    int    i;
+
+    /* Size the next frame. */
+    for (i = 0; i < num_segments && frame_len < usable_body_payload_size; i++) {
+      frame_len += segments[i].len - (i == 0 ? segment_offset : 0);
+    }
+    if (frame_len == 0)
+      return 0;
+    if (frame_len > usable_body_payload_size)
+      frame_len = usable_body_payload_size;
+
+    if (g->offset + HEADER_SIZE > state->outbound_buffer.len
+	|| g->nvecs + 1 > SEND_FRAMES_MAX_IOV)
+    {
+      res = gather_write(state, g);
+      if (res < 0)
+	return res;
+    }
+    e_8_helper(state->outbound_buffer, g->offset, AMQP_FRAME_BODY);
+    e_16_helper(state->outbound_buffer, g->offset + 1, channel);
+    e_32_helper(state->outbound_buffer, g->offset + 3, (uint32_t) frame_len);
+    gather_bytes(g, buf_at(state->outbound_buffer, g->offset), HEADER_SIZE);
+    g->offset += HEADER_SIZE;
+
+    for (left = frame_len; left > 0; ) {
+      size_t piece = segments->len - segment_offset;
+
+      if (piece > left)
+	piece = left;
+      if (piece > 0) {
+	if (g->nvecs + 1 > SEND_FRAMES_MAX_IOV) {
+	  res = gather_write(state, g);
+	  if (res < 0)
+	    return res;
+	}
+	gather_bytes(g, buf_at(*segments, segment_offset), piece);
+      }
+      left -= piece;
+      segment_offset += piece;
+      if (segment_offset == segments->len) {
+	segments++;
+	num_segments--;
+	segment_offset = 0;
+      }
+    }
+
+    if (g->nvecs + 1 > SEND_FRAMES_MAX_IOV) {
+      res = gather_write(state, g);
+      if (res < 0)
+	return res;
+    }
+    gather_bytes(g, &frame_end_byte, FOOTER_SIZE);
+  }
+}
+
+/*
+ * Sends frames, followed by body frames on channel carrying the
+ * concatenation of num_segments segments of body, with as few writes
+ * as possible: all of them go out in one writev, unless the outbound
+ * buffer or SEND_FRAMES_MAX_IOV runs out first. With write coalescing
+ * on, they are coalesced together.
+ */
+int amqp_send_message(amqp_connection_state_t state,
+		      amqp_frame_t const *frames,
+		      int num_frames,
+		      amqp_channel_t channel,
+		      amqp_bytes_t const *body,
+		      int num_segments)
+{
+  frame_gather_t g;
+  int i;
+  int res;
+
+  gather_init(&g);
+
+  for (i = 0; i < num_frames; i++) {
+    res = gather_frame(state, &g, &frames[i]);
+    if (res < 0)
+      return amqp_connection_error(state, res);
+  }
+  res = gather_body(state, &g, channel, body, num_segments);
+  if (res < 0)
+    return amqp_connection_error(state, res);
+  return amqp_connection_error(state, gather_write(state, &g));
+}
+
+/*
+ * Sends num_messages messages, each of them the method and content
+ * header frames and the body that source fills in, gathered together
+ * as amqp_send_message gathers them. A message that fails to encode
+ * is left out and the rest still go; a failed write fails every
+ * message not yet written. If status is not NULL, status[i] is set to
+ * 0 or to the error that message i failed with. Returns 0, the error
+ * of a failed write, or else that of the first message left out.
+ */
+int amqp_send_messages(amqp_connection_state_t state,
+		       amqp_channel_t channel,
+		       size_t num_messages,
+		       amqp_message_source_t source,
+		       void *context,
+		       int *status)
+{
+  frame_gather_t g;
+  amqp_frame_t   frames[2];
+  amqp_bytes_t   body;
+  size_t         unwritten = 0; /* messages before it are written */
+  size_t         i;
+  int            result = 0;
+  int            res = 0;
+
+  gather_init(&g);
+
+  for (i = 0; i < num_messages; i++) {
+    int    nvecs = g.nvecs;
+    size_t offset = g.offset;
+    size_t last_len = nvecs > 0 ? g.iov[nvecs].iov_len : 0;
+    int    writes = g.writes;
+
+    g.mark = g.len;
+    g.split = 0;
+    source(context, i, frames, &body);
+    res = gather_frame(state, &g, &frames[0]);
+    if (res >= 0)
+      res = gather_frame(state, &g, &frames[1]);
+    if (res >= 0)
+      res = gather_body(state, &g, channel, &body, 1);
+
+    if (g.writes != writes)
+      unwritten = i;
+    if (res < 0) {
+      if (g.error != 0 || g.split)
+	break;
+
+      /* None of it has been written, so it can be taken back out. */
+      if (g.writes != writes) {
+	nvecs = 0;
+	offset = 0;
+      }
+      g.nvecs = nvecs;
+      g.offset = offset;
+      g.len = g.mark;
+      if (nvecs > 0)
+	g.iov[nvecs].iov_len = last_len;
+      if (result == 0)
+	result = res;
+    }
+    if (status != NULL)
+      status[i] = res;
+  }
+
+  if (i == num_messages) {
+    res = gather_write(state, &g);
+    if (res >= 0)
+      return amqp_connection_error(state, result);
+  }
+
+  if (status != NULL) {
+    for (; unwritten < num_messages; unwritten++) {
+      if (unwritten >= i || status[unwritten] == 0)
+	status[unwritten] = res;
+    }
+  }
+  return amqp_connection_error(state, res);
 }
 
 int amqp_send_frame_to(amqp_connection_state_t state,
@@ -481,25 +1702,25 @@ int amqp_send_frame_to(amqp_connection_state_t state,
 		       void *context)
 {
   amqp_bytes_t encoded;
-  int payload_len;
+  size_t payload_len;
   int separate_body;
   int result = OK;
 
-  separate_body = inner_send_frame(state, frame, &encoded, &payload_len);
+  separate_body = inner_send_frame(state, frame, 0, &encoded, &payload_len);
   switch (separate_body) {
     case 0:
       result = fn(context,
 			   state->outbound_buffer.bytes,
 			   payload_len + (HEADER_SIZE + FOOTER_SIZE));
-      return result;
+      return amqp_connection_error(state, result);
 
     case 1:
       result = fn(context, state->outbound_buffer.bytes, HEADER_SIZE);
       if( result < 0)
-    	return result;
+    	return amqp_connection_error(state, result);
       result = fn(context, encoded.bytes, payload_len);
       if( result < 0)
-    	return result;
+    	return amqp_connection_error(state, result);
 
       {
 		char frame_end_byte = AMQP_FRAME_END;
@@ -509,11 +1730,11 @@ int amqp_send_frame_to(amqp_connection_state_t state,
 		result = fn(context, &frame_end_byte, FOOTER_SIZE);
 	    
 		if( result < 0 )
-	      return result;
+	      return amqp_connection_error(state, result);
       }
       return 0;
 
     default:
-      return separate_body;
+      return amqp_connection_error(state, separate_body);
   }
 }
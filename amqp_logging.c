@@ -97,7 +97,7 @@ void amqp_closelog(void)
 
 inline void amqp_log_helper(char *pcFile, int nLine, int nPrio, char *pcMsg)
 {
-  static char acBuffer[ MAX_BUFFER_SIZE ];
+  static AMQP_THREAD_LOCAL char acBuffer[ MAX_BUFFER_SIZE ];
   int         bLogged  = 0;
   pfnLogFn_t  pfnLogFn = NULL;
 
@@ -123,7 +123,7 @@ inline void amqp_log_helper(char *pcFile, int nLine, int nPrio, char *pcMsg)
 
 void amqp_log( char *pcFile, int nLine, int nPrio, char *pcFormat, ...)
 {
-  static char acBuffer[ MAX_BUFFER_SIZE ];
+  static AMQP_THREAD_LOCAL char acBuffer[ MAX_BUFFER_SIZE ];
 
   va_list vArgs;
   va_start(vArgs, pcFormat);
@@ -139,7 +139,7 @@ void amqp_log( char *pcFile, int nLine, int nPrio, char *pcFormat, ...)
 
 inline void amqp_error_log_helper(char *pcFile, int nLine, int nPrio, int nError, char *pcMsg)
 {
-  static char acBuffer[ MAX_BUFFER_SIZE ];
+  static AMQP_THREAD_LOCAL char acBuffer[ MAX_BUFFER_SIZE ];
   int         bLogged  = 0;
   pfnLogFn_t  pfnLogFn = NULL;
 
@@ -165,7 +165,7 @@ inline void amqp_error_log_helper(char *pcFile, int nLine, int nPrio, int nError
 
 void amqp_log_error( char *pcFile, int nLine, int nPrio, int nError, char *pcFormat, ...)
 {
-  static char acBuffer[ MAX_BUFFER_SIZE ];
+  static AMQP_THREAD_LOCAL char acBuffer[ MAX_BUFFER_SIZE ];
 
   va_list vArgs;
   va_start(vArgs, pcFormat);
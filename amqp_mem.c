@@ -48,6 +48,10 @@
  * ***** END LICENSE BLOCK *****
  */
 
+#if defined( __linux__ ) && !defined( _GNU_SOURCE )
+#define _GNU_SOURCE /* for sched_getcpu */
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -55,65 +59,580 @@
 #include <sys/types.h>
 #include <assert.h>
 
+#if defined( WIN32 )
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined( __linux__ )
+#include <sched.h>
+#endif
+
 #include "amqp.h"
+#include "amqp_private.h"
 #include "../config.h"
 
 char const *amqp_version(void) {
   return VERSION; /* defined in config.h */
 }
 
-void init_amqp_pool(amqp_pool_t *pool, size_t pagesize) {
-  pool->pagesize = pagesize ? pagesize : 4096;
+static void *default_malloc(void *context, size_t size) {
+  return malloc(size);
+}
 
-  pool->pages.num_blocks = 0;
-  pool->pages.blocklist = NULL;
+static void *default_calloc(void *context, size_t count, size_t size) {
+  return calloc(count, size);
+}
 
-  pool->large_blocks.num_blocks = 0;
-  pool->large_blocks.blocklist = NULL;
+static void *default_realloc(void *context, void *ptr, size_t size) {
+  return realloc(ptr, size);
+}
 
-  pool->next_page = 0;
-  pool->alloc_block = NULL;
-  pool->alloc_used = 0;
+static void default_free(void *context, void *ptr) {
+  free(ptr);
+}
+
+static amqp_allocator_t const default_allocator = {
+  default_malloc,
+  default_calloc,
+  default_realloc,
+  default_free,
+  NULL
+};
+
+static amqp_allocator_t const *library_allocator = &default_allocator;
+
+/*
+ * Installs the allocator used by pools and connections created from
+ * now on, and by amqp_bytes_malloc() and friends. Passing NULL goes
+ * back to the C library's allocator. Memory must be released through
+ * the allocator that provided it, so switch allocators before
+ * creating any connections.
+ */
+void amqp_set_allocator(amqp_allocator_t const *allocator) {
+  library_allocator = allocator ? allocator : &default_allocator;
+}
+
+amqp_allocator_t const *amqp_get_allocator(void) {
+  return library_allocator;
+}
+
+/*
+ * The process-wide page cache: pool pages, large blocks and socket
+ * buffers that connections no longer need, kept for reuse by other
+ * connections instead of going back to the C library. Only memory
+ * from the default allocator is cached, since anything else may be
+ * tied to one connection or thread.
+ *
+ * The cache is split into shards, each guarded by a spinlock and
+ * holding a few bins of same-sized blocks. A thread puts blocks in
+ * the shard of the CPU it is running on, and takes them from there,
+ * stealing from other shards only on a miss. The cache is off until
+ * amqp_set_page_cache_limit() gives it a size.
+ */
+#define PAGE_CACHE_SHARDS 16
+#define PAGE_CACHE_BINS 8
+#define PAGE_CACHE_MIN_BLOCK_SIZE 4096
+
+typedef struct page_cache_bin_t_ {
+  size_t size; /* of each block; 0 if the bin is unused */
+  void *head; /* blocks, each starting with a pointer to the next */
+  int count;
+} page_cache_bin_t;
+
+typedef struct page_cache_shard_t_ {
+  volatile long lock;
+  volatile size_t bytes; /* peeked at without the lock */
+  page_cache_bin_t bins[PAGE_CACHE_BINS];
+} page_cache_shard_t;
+
+#if defined( _MSC_VER )
+#define PAGE_CACHE_ALIGNED __declspec(align(64))
+#else
+#define PAGE_CACHE_ALIGNED __attribute__((aligned(64)))
+#endif
+
+/* Padded and aligned so that shards do not share cache lines. */
+static union PAGE_CACHE_ALIGNED {
+  page_cache_shard_t shard;
+  char pad[(sizeof(page_cache_shard_t) + 63) & ~63];
+} page_cache[PAGE_CACHE_SHARDS];
+
+static volatile size_t page_cache_limit = 0;
+
+#if defined( WIN32 )
+#define page_cache_trylock(s) (InterlockedCompareExchange(&(s)->lock, 1, 0) == 0)
+#define page_cache_unlock(s) InterlockedExchange(&(s)->lock, 0)
+#else
+#define page_cache_trylock(s) (__sync_lock_test_and_set(&(s)->lock, 1) == 0)
+#define page_cache_unlock(s) __sync_lock_release(&(s)->lock)
+#endif
+
+static void page_cache_lock(page_cache_shard_t *shard) {
+  while (!page_cache_trylock(shard)) {
+    while (shard->lock) {
+      /* spin until it looks free */
+    }
+  }
+}
+
+static int page_cache_home(void) {
+#if defined( WIN32 )
+  return GetCurrentProcessorNumber() % PAGE_CACHE_SHARDS;
+#elif defined( __linux__ )
+  int cpu = sched_getcpu();
+  return cpu < 0 ? 0 : cpu % PAGE_CACHE_SHARDS;
+#else
+  /* Stacks of different threads are far apart. */
+  int local;
+  return (int) (((size_t) &local >> 16) % PAGE_CACHE_SHARDS);
+#endif
 }
 
-static void empty_blocklist(amqp_pool_blocklist_t *x) {
+/* The shard must be locked. */
+static void *page_cache_take(page_cache_shard_t *shard, size_t size) {
   int i;
 
-  for (i = 0; i < x->num_blocks; i++) {
-    free(x->blocklist[i]);
+  for (i = 0; i < PAGE_CACHE_BINS; i++) {
+    page_cache_bin_t *bin = &shard->bins[i];
+
+    if (bin->size == size && bin->head != NULL) {
+      void *block = bin->head;
+      bin->head = *(void **) block;
+      if (--bin->count == 0) {
+	bin->size = 0;
+      }
+      shard->bytes -= size;
+      return block;
+    }
   }
-  if (x->blocklist != NULL) {
-    free(x->blocklist);
+  return NULL;
+}
+
+static void *page_cache_get(size_t size) {
+  int home, i;
+
+  if (page_cache_limit == 0 || size < PAGE_CACHE_MIN_BLOCK_SIZE) {
+    return NULL;
+  }
+
+  home = page_cache_home();
+  for (i = 0; i < PAGE_CACHE_SHARDS; i++) {
+    page_cache_shard_t *shard = &page_cache[(home + i) % PAGE_CACHE_SHARDS].shard;
+    void *block;
+
+    if (shard->bytes < size) {
+      continue; /* unlocked peek; a stale answer only costs a miss */
+    }
+    if (i == 0) {
+      page_cache_lock(shard);
+    } else if (!page_cache_trylock(shard)) {
+      continue;
+    }
+    block = page_cache_take(shard, size);
+    page_cache_unlock(shard);
+    if (block != NULL) {
+      return block;
+    }
+  }
+  return NULL;
+}
+
+/* Returns 1 if the cache took the block, 0 if it must be freed. */
+static int page_cache_put(void *block, size_t size) {
+  page_cache_shard_t *shard;
+  page_cache_bin_t *bin = NULL;
+  int i;
+
+  if (page_cache_limit == 0 || size < PAGE_CACHE_MIN_BLOCK_SIZE) {
+    return 0;
+  }
+
+  shard = &page_cache[page_cache_home()].shard;
+  page_cache_lock(shard);
+  if (shard->bytes + size <= page_cache_limit / PAGE_CACHE_SHARDS) {
+    for (i = 0; i < PAGE_CACHE_BINS; i++) {
+      if (shard->bins[i].size == size) {
+	bin = &shard->bins[i];
+	break;
+      }
+      if (bin == NULL && shard->bins[i].size == 0) {
+	bin = &shard->bins[i];
+      }
+    }
+  }
+  if (bin != NULL) {
+    bin->size = size;
+    *(void **) block = bin->head;
+    bin->head = block;
+    bin->count++;
+    shard->bytes += size;
+  }
+  page_cache_unlock(shard);
+
+  return bin != NULL;
+}
+
+/*
+ * Sets how many bytes of spare memory the process-wide page cache
+ * may hold; 0, the default, turns it off. Lowering the limit frees
+ * what no longer fits.
+ */
+void amqp_set_page_cache_limit(size_t bytes) {
+  int i, j;
+
+  page_cache_limit = bytes;
+
+  for (i = 0; i < PAGE_CACHE_SHARDS; i++) {
+    page_cache_shard_t *shard = &page_cache[i].shard;
+    void *evicted = NULL;
+
+    page_cache_lock(shard);
+    for (j = 0; j < PAGE_CACHE_BINS && shard->bytes > bytes / PAGE_CACHE_SHARDS; j++) {
+      page_cache_bin_t *bin = &shard->bins[j];
+
+      while (bin->head != NULL && shard->bytes > bytes / PAGE_CACHE_SHARDS) {
+	void *block = page_cache_take(shard, bin->size);
+	*(void **) block = evicted;
+	evicted = block;
+      }
+    }
+    page_cache_unlock(shard);
+
+    while (evicted != NULL) {
+      void *next = *(void **) evicted;
+      free(evicted);
+      evicted = next;
+    }
+  }
+}
+
+/*
+ * Allocation and release of big blocks whose size is known when they
+ * are freed, going through the page cache where the allocator allows.
+ */
+void *amqp_cached_malloc(amqp_allocator_t const *allocator, size_t size) {
+  if (allocator == &default_allocator) {
+    void *block = page_cache_get(size);
+    if (block != NULL) {
+      return block;
+    }
+  }
+  return amqp_malloc(allocator, size);
+}
+
+void *amqp_cached_calloc(amqp_allocator_t const *allocator, size_t size) {
+  if (allocator == &default_allocator) {
+    void *block = page_cache_get(size);
+    if (block != NULL) {
+      memset(block, 0, size);
+      return block;
+    }
+  }
+  return amqp_calloc(allocator, 1, size);
+}
+
+void amqp_cached_free(amqp_allocator_t const *allocator, void *block, size_t size) {
+  if (block == NULL
+      || (allocator == &default_allocator && page_cache_put(block, size))) {
+    return;
   }
+  amqp_free(allocator, block);
+}
+
+/*
+ * The mapped allocator behind amqp_set_memory_mode(). Blocks of at
+ * least MAPPED_MIN_BLOCK_SIZE bytes (pool pages, large blocks and
+ * socket buffers) are carved out of anonymous mappings of
+ * MAPPED_REGION_SIZE bytes, one huge page on common platforms, so
+ * that they can be backed by huge pages, prefaulted and locked as a
+ * whole. Smaller blocks (pool bookkeeping) come from the fallback
+ * allocator.
+ *
+ * Regions are bump-allocated: a region is unmapped once every block
+ * carved from it has been freed, and the current region is rewound
+ * instead. Pools free their pages rarely, so this wastes little.
+ */
+#define MAPPED_REGION_SIZE (2 * 1024 * 1024)
+#define MAPPED_MIN_BLOCK_SIZE 4096
+
+struct amqp_mapped_region_t_ {
+  size_t length; /* of the whole mapping, this header included */
+  size_t used;
+  int live_blocks;
+};
+
+/* Blocks start this far into a region, keeping them 16-byte aligned. */
+#define MAPPED_REGION_HEADER_SIZE ((sizeof(amqp_mapped_region_t) + 15) & ~(size_t) 15)
+
+/* Precedes every block. */
+typedef struct amqp_mapped_block_t_ {
+  amqp_mapped_region_t *region; /* NULL if from the fallback allocator */
+  size_t size;
+} amqp_mapped_block_t;
+
+#if !defined( WIN32 )
+
+static size_t round_up(size_t n, size_t multiple) {
+  return (n + multiple - 1) / multiple * multiple;
+}
+
+/*
+ * Maps length bytes (a multiple of MAPPED_REGION_SIZE) and applies
+ * as many of the requested memory mode flags as the system allows,
+ * clearing from m->achieved those it could not.
+ */
+static void *map_region(amqp_mapped_allocator_t *m, size_t length) {
+  int prot = PROT_READ | PROT_WRITE;
+  int mapflags = MAP_PRIVATE | MAP_ANONYMOUS;
+  char *p = MAP_FAILED;
+  long page_size = sysconf(_SC_PAGESIZE);
+
+#if defined( MAP_HUGETLB )
+  if (m->flags & AMQP_MEMORY_HUGE_PAGES) {
+    /* Fails unless huge pages have been reserved by the administrator. */
+    p = mmap(NULL, length, prot, mapflags | MAP_HUGETLB, -1, 0);
+  }
+#endif
+
+  if (p == MAP_FAILED && (m->flags & AMQP_MEMORY_HUGE_PAGES)) {
+    /* Fall back to transparent huge pages, which only cover aligned
+       ranges: over-map and trim to a MAPPED_REGION_SIZE boundary. */
+    char *raw = mmap(NULL, length + MAPPED_REGION_SIZE, prot, mapflags, -1, 0);
+    if (raw == MAP_FAILED) {
+      return NULL;
+    }
+    p = (char *) round_up((size_t) raw, MAPPED_REGION_SIZE);
+    if (p != raw) {
+      munmap(raw, p - raw);
+    }
+    munmap(p + length, raw + MAPPED_REGION_SIZE - p);
+
+#if defined( MADV_HUGEPAGE )
+    if (madvise(p, length, MADV_HUGEPAGE) != 0) {
+      m->achieved &= ~AMQP_MEMORY_HUGE_PAGES;
+    }
+#else
+    m->achieved &= ~AMQP_MEMORY_HUGE_PAGES;
+#endif
+  }
+
+  if (p == MAP_FAILED) {
+    p = mmap(NULL, length, prot, mapflags, -1, 0);
+    if (p == MAP_FAILED) {
+      return NULL;
+    }
+  }
+
+  if (m->flags & AMQP_MEMORY_PREFAULT) {
+    size_t i;
+    for (i = 0; i < length; i += page_size) {
+      ((volatile char *) p)[i] = 0;
+    }
+  }
+
+  if ((m->flags & AMQP_MEMORY_LOCKED) && mlock(p, length) != 0) {
+    /* Typically RLIMIT_MEMLOCK; the memory is still usable. */
+    m->achieved &= ~AMQP_MEMORY_LOCKED;
+  }
+
+  return p;
+}
+
+static void *mapped_malloc(void *context, size_t size) {
+  amqp_mapped_allocator_t *m = context;
+  amqp_mapped_region_t *region = m->current;
+  amqp_mapped_block_t *block;
+  size_t needed = sizeof(amqp_mapped_block_t) + round_up(size, 16);
+
+  if (size < MAPPED_MIN_BLOCK_SIZE) {
+    block = amqp_malloc(m->fallback, sizeof(amqp_mapped_block_t) + size);
+    if (block == NULL) {
+      return NULL;
+    }
+    block->region = NULL;
+    block->size = size;
+    return block + 1;
+  }
+
+  if (region == NULL || region->used + needed > region->length) {
+    size_t length = round_up(MAPPED_REGION_HEADER_SIZE + needed, MAPPED_REGION_SIZE);
+
+    region = map_region(m, length);
+    if (region == NULL) {
+      return NULL;
+    }
+    region->length = length;
+    region->used = MAPPED_REGION_HEADER_SIZE;
+    region->live_blocks = 0;
+
+    if (m->current != NULL && m->current->live_blocks == 0) {
+      munmap(m->current, m->current->length);
+    }
+    m->current = region;
+  }
+
+  block = (amqp_mapped_block_t *) ((char *) region + region->used);
+  block->region = region;
+  block->size = size;
+  region->used += needed;
+  region->live_blocks++;
+  return block + 1;
+}
+
+static void *mapped_calloc(void *context, size_t count, size_t size) {
+  void *result = mapped_malloc(context, count * size);
+  if (result != NULL) {
+    memset(result, 0, count * size);
+  }
+  return result;
+}
+
+static void mapped_free(void *context, void *ptr) {
+  amqp_mapped_allocator_t *m = context;
+  amqp_mapped_block_t *block;
+  amqp_mapped_region_t *region;
+
+  if (ptr == NULL) {
+    return;
+  }
+
+  block = (amqp_mapped_block_t *) ptr - 1;
+  region = block->region;
+  if (region == NULL) {
+    amqp_free(m->fallback, block);
+    return;
+  }
+
+  region->live_blocks--;
+  if (region->live_blocks == 0) {
+    if (region == m->current) {
+      region->used = MAPPED_REGION_HEADER_SIZE;
+    } else {
+      munmap(region, region->length);
+    }
+  }
+}
+
+static void *mapped_realloc(void *context, void *ptr, size_t size) {
+  void *result = mapped_malloc(context, size);
+
+  if (result != NULL && ptr != NULL) {
+    amqp_mapped_block_t *block = (amqp_mapped_block_t *) ptr - 1;
+    memcpy(result, ptr, block->size < size ? block->size : size);
+    mapped_free(context, ptr);
+  }
+  return result;
+}
+
+/*
+ * Sets up m as a mapped allocator honouring the given AMQP_MEMORY_*
+ * flags. Returns 0 if memory modes are not supported on this
+ * platform.
+ */
+int amqp_mapped_allocator_init(amqp_mapped_allocator_t *m,
+			       amqp_allocator_t const *fallback,
+			       int flags)
+{
+  m->allocator.malloc_fn = mapped_malloc;
+  m->allocator.calloc_fn = mapped_calloc;
+  m->allocator.realloc_fn = mapped_realloc;
+  m->allocator.free_fn = mapped_free;
+  m->allocator.context = m;
+  m->fallback = fallback;
+  m->flags = flags;
+  m->achieved = flags;
+  m->current = NULL;
+  return 1;
+}
+
+/* Unmaps the current region; every block must have been freed. */
+void amqp_mapped_allocator_destroy(amqp_mapped_allocator_t *m) {
+  if (m->current != NULL) {
+    assert(m->current->live_blocks == 0);
+    munmap(m->current, m->current->length);
+    m->current = NULL;
+  }
+}
+
+#else
+
+int amqp_mapped_allocator_init(amqp_mapped_allocator_t *m,
+			       amqp_allocator_t const *fallback,
+			       int flags)
+{
+  return 0;
+}
+
+void amqp_mapped_allocator_destroy(amqp_mapped_allocator_t *m) {
+}
+
+#endif
+
+/*
+ * Large blocks are prefixed with this header, so that
+ * recycle_amqp_pool() knows which free list to put them back on. Its
+ * size is a multiple of 8 bytes, preserving the alignment that
+ * amqp_pool_alloc promises.
+ */
+typedef struct amqp_pool_large_header_t_ {
+  size_t size;    /* usable bytes following the header */
+  int size_class; /* index into free_blocks, or -1 if oversized */
+} amqp_pool_large_header_t;
+
+#define INITIAL_BLOCKLIST_CAPACITY 8
+
+static void init_blocklist(amqp_pool_blocklist_t *x) {
   x->num_blocks = 0;
+  x->capacity = 0;
   x->blocklist = NULL;
 }
 
-void recycle_amqp_pool(amqp_pool_t *pool) {
-  empty_blocklist(&pool->large_blocks);
+void init_amqp_pool(amqp_pool_t *pool, size_t pagesize) {
+  int i;
+
+  pool->pagesize = pagesize ? pagesize : 4096;
+  pool->flags = 0;
+  pool->allocator = library_allocator;
+  pool->high_water_mark = 0;
+
+  init_blocklist(&pool->pages);
+  init_blocklist(&pool->large_blocks);
+  for (i = 0; i < AMQP_POOL_SIZE_CLASSES; i++) {
+    init_blocklist(&pool->free_blocks[i]);
+  }
+
   pool->next_page = 0;
   pool->alloc_block = NULL;
   pool->alloc_used = 0;
+
+  memset(&pool->stats, 0, sizeof(pool->stats));
 }
 
-void empty_amqp_pool(amqp_pool_t *pool) {
-  recycle_amqp_pool(pool);
-  empty_blocklist(&pool->pages);
+static void empty_blocklist(amqp_allocator_t const *allocator, amqp_pool_blocklist_t *x,
+			    size_t block_size) {
+  int i;
+
+  for (i = 0; i < x->num_blocks; i++) {
+    amqp_cached_free(allocator, x->blocklist[i], block_size);
+  }
+  if (x->blocklist != NULL) {
+    amqp_free(allocator, x->blocklist);
+  }
+  init_blocklist(x);
 }
 
 /* Returns 1 on success, 0 on failure */
-static int record_pool_block(amqp_pool_blocklist_t *x, void *block) {
-  size_t blocklistlength = sizeof(void *) * (x->num_blocks + 1);
-
-  if (x->blocklist == NULL) {
-    x->blocklist = malloc(blocklistlength);
-    if (x->blocklist == NULL)
-      return 0;
-  } else {
-    void *newbl = realloc(x->blocklist, blocklistlength);
+static int record_pool_block(amqp_allocator_t const *allocator, amqp_pool_blocklist_t *x, void *block) {
+  if (x->num_blocks >= x->capacity) {
+    int newcapacity = x->capacity ? x->capacity * 2 : INITIAL_BLOCKLIST_CAPACITY;
+    void *newbl = amqp_realloc(allocator, x->blocklist, sizeof(void *) * newcapacity);
     if (newbl == NULL)
       return 0;
     x->blocklist = newbl;
+    x->capacity = newcapacity;
   }
 
   x->blocklist[x->num_blocks] = block;
@@ -121,23 +640,312 @@ static int record_pool_block(amqp_pool_blocklist_t *x, void *block) {
   return 1;
 }
 
-void *amqp_pool_alloc(amqp_pool_t *pool, size_t amount) {
-  if (amount == 0) {
-    return NULL;
+/* Must be called while the pool holds no memory. */
+void amqp_pool_set_allocator(amqp_pool_t *pool, amqp_allocator_t const *allocator) {
+  assert(pool->pages.blocklist == NULL && pool->large_blocks.blocklist == NULL);
+  pool->allocator = allocator ? allocator : library_allocator;
+}
+
+void amqp_pool_set_flags(amqp_pool_t *pool, int flags) {
+  pool->flags = flags;
+}
+
+void amqp_pool_set_high_water_mark(amqp_pool_t *pool, size_t bytes) {
+  pool->high_water_mark = bytes;
+}
+
+static void *new_block(amqp_pool_t *pool, size_t size) {
+  if (pool->flags & AMQP_POOL_NO_ZERO_FILL) {
+    return amqp_cached_malloc(pool->allocator, size);
+  } else {
+    return amqp_cached_calloc(pool->allocator, size);
   }
+}
 
-  amount = (amount + 7) & (~7); /* round up to nearest 8-byte boundary */
+/* A large block's size as allocated, header included. */
+#define LARGE_BLOCK_SIZE(usable) (sizeof(amqp_pool_large_header_t) + (usable))
 
-  if (amount > pool->pagesize) {
-    void *result = calloc(1, amount);
-    if (result == NULL) {
-      return NULL;
+static void hold_bytes(amqp_pool_t *pool, size_t size) {
+  pool->stats.bytes_held += size;
+  if (pool->stats.bytes_held > pool->stats.peak_bytes_held) {
+    pool->stats.peak_bytes_held = pool->stats.bytes_held;
+  }
+}
+
+static void release_bytes(amqp_pool_t *pool, size_t size) {
+  pool->stats.bytes_held -= size;
+}
+
+/*
+ * Gives memory beyond the pool's high-water mark back to the system,
+ * largest free blocks first, then pages from the end of the page
+ * list. Must only be called on a freshly recycled pool.
+ */
+static void trim_amqp_pool(amqp_pool_t *pool) {
+  size_t retained = pool->pages.num_blocks * pool->pagesize;
+  int i;
+
+  for (i = 0; i < AMQP_POOL_SIZE_CLASSES; i++) {
+    retained += pool->free_blocks[i].num_blocks * (pool->pagesize << (i + 1));
+  }
+
+  for (i = AMQP_POOL_SIZE_CLASSES - 1; i >= 0 && retained > pool->high_water_mark; i--) {
+    amqp_pool_blocklist_t *freelist = &pool->free_blocks[i];
+
+    while (freelist->num_blocks > 0 && retained > pool->high_water_mark) {
+      freelist->num_blocks--;
+      amqp_cached_free(pool->allocator, freelist->blocklist[freelist->num_blocks],
+		       LARGE_BLOCK_SIZE(pool->pagesize << (i + 1)));
+      retained -= pool->pagesize << (i + 1);
+      release_bytes(pool, pool->pagesize << (i + 1));
+    }
+  }
+
+  while (pool->pages.num_blocks > 0 && retained > pool->high_water_mark) {
+    pool->pages.num_blocks--;
+    amqp_cached_free(pool->allocator, pool->pages.blocklist[pool->pages.num_blocks], pool->pagesize);
+    retained -= pool->pagesize;
+    release_bytes(pool, pool->pagesize);
+  }
+}
+
+/* Moves the large blocks from index first on to the free lists. */
+static void retire_large_blocks(amqp_pool_t *pool, int first) {
+  int i;
+
+  for (i = first; i < pool->large_blocks.num_blocks; i++) {
+    amqp_pool_large_header_t *block = pool->large_blocks.blocklist[i];
+
+    if (block == NULL) {
+      continue; /* detached */
+    }
+    if (block->size_class < 0
+	|| !record_pool_block(pool->allocator, &pool->free_blocks[block->size_class], block))
+    {
+      release_bytes(pool, block->size);
+      amqp_cached_free(pool->allocator, block, LARGE_BLOCK_SIZE(block->size));
+    }
+  }
+  pool->large_blocks.num_blocks = first;
+}
+
+/* Closes up the slots left in the page list by detached pages. */
+static void compact_pages(amqp_pool_t *pool, int first) {
+  int i, j;
+
+  for (i = j = first; i < pool->pages.num_blocks; i++) {
+    if (pool->pages.blocklist[i] != NULL) {
+      pool->pages.blocklist[j++] = pool->pages.blocklist[i];
     }
-    if (!record_pool_block(&pool->large_blocks, result))
+  }
+  pool->pages.num_blocks = j;
+}
+
+void recycle_amqp_pool(amqp_pool_t *pool) {
+  retire_large_blocks(pool, 0);
+  compact_pages(pool, 0);
+
+  pool->next_page = 0;
+  pool->alloc_block = NULL;
+  pool->alloc_used = 0;
+
+  pool->stats.bytes_in_use = 0;
+  pool->stats.recycles++;
+
+  if (pool->high_water_mark != 0) {
+    trim_amqp_pool(pool);
+  }
+}
+
+/*
+ * Records how much of the pool is in use, so that amqp_pool_rewind()
+ * can later take back everything allocated after this point.
+ */
+void amqp_pool_mark(amqp_pool_t const *pool, amqp_pool_mark_t *mark) {
+  mark->next_page = pool->next_page;
+  mark->alloc_block = pool->alloc_block;
+  mark->alloc_used = pool->alloc_used;
+  mark->num_large_blocks = pool->large_blocks.num_blocks;
+  mark->bytes_in_use = pool->stats.bytes_in_use;
+}
+
+/*
+ * Frees everything allocated from the pool since the mark was taken:
+ * the space on pages is reused by later allocations and large blocks
+ * go back on the free lists. Marks are invalidated by recycling the
+ * pool and by rewinding to an earlier mark.
+ */
+void amqp_pool_rewind(amqp_pool_t *pool, amqp_pool_mark_t const *mark) {
+  assert(mark->next_page <= pool->next_page
+	 && mark->num_large_blocks <= pool->large_blocks.num_blocks);
+
+  retire_large_blocks(pool, mark->num_large_blocks);
+  compact_pages(pool, mark->next_page);
+
+  pool->next_page = mark->next_page;
+  pool->alloc_block = mark->alloc_block;
+  pool->alloc_used = mark->alloc_used;
+  pool->stats.bytes_in_use = mark->bytes_in_use;
+}
+
+/*
+ * Takes the page or large block that the allocation at ptr occupies
+ * out of the pool, so that the pool neither reuses nor frees it.
+ * Only for allocations that filled a whole page or large block: the
+ * rest of a detached page is never handed out again, but marks taken
+ * while it was the current page still refer to it. Returns 1 if ptr
+ * was found among the blocks in use, 0 otherwise.
+ */
+int amqp_pool_detach(amqp_pool_t *pool, void *ptr, amqp_pool_detached_t *detached) {
+  int i;
+
+  for (i = pool->next_page - 1; i >= 0; i--) {
+    if (pool->pages.blocklist[i] == ptr) {
+      pool->pages.blocklist[i] = NULL;
+      if (pool->alloc_block == ptr) {
+	pool->alloc_block = NULL;
+      }
+      release_bytes(pool, pool->pagesize);
+      detached->block = ptr;
+      detached->allocator = pool->allocator;
+      detached->pagesize = pool->pagesize;
+      return 1;
+    }
+  }
+
+  for (i = pool->large_blocks.num_blocks - 1; i >= 0; i--) {
+    amqp_pool_large_header_t *block = pool->large_blocks.blocklist[i];
+
+    if (block != NULL && (void *) (block + 1) == ptr) {
+      pool->large_blocks.blocklist[i] = NULL;
+      release_bytes(pool, block->size);
+      detached->block = block;
+      detached->allocator = pool->allocator;
+      detached->pagesize = 0;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Gives a detached page or large block back to a pool, as a spare
+ * page or on a free list, or frees it if the pool has no place for
+ * it (its page size or allocator has changed, say).
+ */
+void amqp_pool_reattach(amqp_pool_t *pool, amqp_pool_detached_t const *detached) {
+  if (detached->allocator != pool->allocator) {
+    /* fall through to freeing it */
+  } else if (detached->pagesize != 0) {
+    if (detached->pagesize == pool->pagesize
+	&& record_pool_block(pool->allocator, &pool->pages, detached->block))
+    {
+      hold_bytes(pool, pool->pagesize);
+      return;
+    }
+  } else {
+    amqp_pool_large_header_t *block = detached->block;
+
+    if (block->size_class >= 0
+	&& block->size == pool->pagesize << (block->size_class + 1)
+	&& record_pool_block(pool->allocator, &pool->free_blocks[block->size_class], block))
+    {
+      hold_bytes(pool, block->size);
+      return;
+    }
+  }
+
+  amqp_pool_free_detached(detached);
+}
+
+void amqp_pool_free_detached(amqp_pool_detached_t const *detached) {
+  size_t size = detached->pagesize;
+
+  if (size == 0) {
+    size = LARGE_BLOCK_SIZE(((amqp_pool_large_header_t *) detached->block)->size);
+  }
+  amqp_cached_free(detached->allocator, detached->block, size);
+}
+
+void empty_amqp_pool(amqp_pool_t *pool) {
+  int i;
+
+  recycle_amqp_pool(pool);
+  empty_blocklist(pool->allocator, &pool->large_blocks, 0); /* emptied by the recycle */
+  for (i = 0; i < AMQP_POOL_SIZE_CLASSES; i++) {
+    empty_blocklist(pool->allocator, &pool->free_blocks[i],
+		    LARGE_BLOCK_SIZE(pool->pagesize << (i + 1)));
+  }
+  empty_blocklist(pool->allocator, &pool->pages, pool->pagesize);
+  pool->stats.bytes_held = 0;
+}
+
+/*
+ * Makes sure the pool holds at least num_pages pages, so that the
+ * allocations filling them do not have to call the allocator.
+ */
+int amqp_pool_reserve(amqp_pool_t *pool, int num_pages) {
+  while (pool->pages.num_blocks < num_pages) {
+    void *page = new_block(pool, pool->pagesize);
+    if (page == NULL) {
+      return -ERROR_NO_MEMORY;
+    }
+    if (!record_pool_block(pool->allocator, &pool->pages, page)) {
+      amqp_cached_free(pool->allocator, page, pool->pagesize);
+      return -ERROR_NO_MEMORY;
+    }
+    hold_bytes(pool, pool->pagesize);
+  }
+  return 0;
+}
+
+static void *alloc_large_block(amqp_pool_t *pool, size_t amount) {
+  amqp_pool_large_header_t *block = NULL;
+  int size_class = 0;
+  size_t size = pool->pagesize;
+
+  while (size < amount && size_class < AMQP_POOL_SIZE_CLASSES) {
+    size <<= 1;
+    size_class++;
+  }
+
+  if (size < amount) {
+    /* Too big for any size class: allocate it exactly, and let
+       recycle_amqp_pool free it again. */
+    size = amount;
+    size_class = -1;
+  } else {
+    amqp_pool_blocklist_t *freelist;
+
+    size_class--; /* class 0 is pagesize << 1 */
+    freelist = &pool->free_blocks[size_class];
+    if (freelist->num_blocks > 0) {
+      freelist->num_blocks--;
+      block = freelist->blocklist[freelist->num_blocks];
+    }
+  }
+
+  if (block == NULL) {
+    block = new_block(pool, LARGE_BLOCK_SIZE(size));
+    if (block == NULL) {
       return NULL;
-    return result;
+    }
+    block->size = size;
+    block->size_class = size_class;
+    hold_bytes(pool, size);
   }
 
+  if (!record_pool_block(pool->allocator, &pool->large_blocks, block)) {
+    release_bytes(pool, block->size);
+    amqp_cached_free(pool->allocator, block, LARGE_BLOCK_SIZE(block->size));
+    return NULL;
+  }
+
+  return block + 1;
+}
+
+static void *alloc_from_page(amqp_pool_t *pool, size_t amount) {
   if (pool->alloc_block != NULL) {
     assert(pool->alloc_used <= pool->pagesize);
 
@@ -149,12 +957,16 @@ void *amqp_pool_alloc(amqp_pool_t *pool, size_t amount) {
   }
 
   if (pool->next_page >= pool->pages.num_blocks) {
-    pool->alloc_block = calloc(1, pool->pagesize);
+    pool->alloc_block = new_block(pool, pool->pagesize);
     if (pool->alloc_block == NULL) {
       return NULL;
     }
-    if (!record_pool_block(&pool->pages, pool->alloc_block))
+    if (!record_pool_block(pool->allocator, &pool->pages, pool->alloc_block)) {
+      amqp_cached_free(pool->allocator, pool->alloc_block, pool->pagesize);
+      pool->alloc_block = NULL;
       return NULL;
+    }
+    hold_bytes(pool, pool->pagesize);
     pool->next_page = pool->pages.num_blocks;
   } else {
     pool->alloc_block = pool->pages.blocklist[pool->next_page];
@@ -166,6 +978,44 @@ void *amqp_pool_alloc(amqp_pool_t *pool, size_t amount) {
   return pool->alloc_block;
 }
 
+void *amqp_pool_alloc(amqp_pool_t *pool, size_t amount) {
+  void *result;
+
+  if (amount == 0) {
+    return NULL;
+  }
+
+  amount = (amount + 7) & (~7); /* round up to nearest 8-byte boundary */
+
+  if (amount > pool->pagesize) {
+    result = alloc_large_block(pool, amount);
+  } else {
+    result = alloc_from_page(pool, amount);
+  }
+
+  if (result != NULL) {
+    pool->stats.bytes_in_use += amount;
+    if (pool->stats.bytes_in_use > pool->stats.peak_bytes_in_use) {
+      pool->stats.peak_bytes_in_use = pool->stats.bytes_in_use;
+    }
+  }
+
+  return result;
+}
+
+void amqp_pool_get_stats(amqp_pool_t const *pool, amqp_pool_stats_t *stats) {
+  int i;
+
+  *stats = pool->stats;
+  stats->pages_in_use = pool->next_page;
+  stats->pages_held = pool->pages.num_blocks;
+  stats->large_blocks_in_use = pool->large_blocks.num_blocks;
+  stats->large_blocks_free = 0;
+  for (i = 0; i < AMQP_POOL_SIZE_CLASSES; i++) {
+    stats->large_blocks_free += pool->free_blocks[i].num_blocks;
+  }
+}
+
 void amqp_pool_alloc_bytes(amqp_pool_t *pool, size_t amount, amqp_bytes_t *output) {
   output->len = amount;
   output->bytes = amqp_pool_alloc(pool, amount);
@@ -181,7 +1031,7 @@ amqp_bytes_t amqp_cstring_bytes(char const *cstr) {
 amqp_bytes_t amqp_bytes_malloc_dup(amqp_bytes_t src) {
   amqp_bytes_t result;
   result.len = src.len;
-  result.bytes = malloc(src.len);
+  result.bytes = amqp_malloc(library_allocator, src.len);
   if (result.bytes != NULL) {
     memcpy(result.bytes, src.bytes, src.len);
   }
@@ -191,7 +1041,7 @@ amqp_bytes_t amqp_bytes_malloc_dup(amqp_bytes_t src) {
 amqp_bytes_t amqp_bytes_malloc(size_t amount) {
   amqp_bytes_t result;
   result.len = amount;
-  result.bytes = malloc(amount); /* will return NULL if it fails */
+  result.bytes = amqp_malloc(library_allocator, amount); /* will return NULL if it fails */
   return result;
 }
 
@@ -199,7 +1049,7 @@ void amqp_bytes_free(amqp_bytes_t bytes)
 {
   if (bytes.bytes != NULL)
   {
-     free(bytes.bytes);
+     amqp_free(library_allocator, bytes.bytes);
      bytes.bytes = NULL;
      bytes.len   = 0;
   }
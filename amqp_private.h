@@ -53,6 +53,11 @@
 
 /* $Header$ */
 
+#include <string.h>
+#if defined( _MSC_VER )
+#include <stdlib.h> /* for _byteswap_* */
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -93,10 +98,79 @@ extern "C" {
 #define ERROR_INCOMPATIBLE_AMQP_VERSION    6
 #define ERROR_CONNECTION_CLOSED            7
 #define ERROR_LIMIT_OUT_OF_BOUNDS          8
+#define ERROR_FRAME_TOO_LARGE              9
+
+#define ERROR_MAX                          9
+
+/* Storage class for per-thread state: the last error and the
+   scratch buffers used for log messages. */
+
+#if defined( _MSC_VER )
+#define AMQP_THREAD_LOCAL __declspec(thread)
+#elif defined( __STDC_VERSION__ ) && __STDC_VERSION__ >= 201112L && !defined( __STDC_NO_THREADS__ )
+#define AMQP_THREAD_LOCAL _Thread_local
+#else
+#define AMQP_THREAD_LOCAL __thread
+#endif
 
-#define ERROR_MAX                          8
+extern AMQP_THREAD_LOCAL int g_errno;
 
 extern void  amqp_set_error(int error);
+
+/* Allocation through an amqp_allocator_t; see amqp_set_allocator(). */
+
+static inline void *amqp_malloc(amqp_allocator_t const *allocator, size_t size)
+{
+  return allocator->malloc_fn(allocator->context, size);
+}
+
+static inline void *amqp_calloc(amqp_allocator_t const *allocator, size_t count, size_t size)
+{
+  return allocator->calloc_fn(allocator->context, count, size);
+}
+
+static inline void *amqp_realloc(amqp_allocator_t const *allocator, void *ptr, size_t size)
+{
+  return allocator->realloc_fn(allocator->context, ptr, size);
+}
+
+static inline void amqp_free(amqp_allocator_t const *allocator, void *ptr)
+{
+  allocator->free_fn(allocator->context, ptr);
+}
+
+extern void *amqp_cached_malloc(amqp_allocator_t const *allocator, size_t size);
+extern void *amqp_cached_calloc(amqp_allocator_t const *allocator, size_t size);
+extern void amqp_cached_free(amqp_allocator_t const *allocator, void *block, size_t size);
+
+typedef struct amqp_mapped_region_t_ amqp_mapped_region_t;
+
+/* An allocator serving big blocks from anonymous mappings; see
+   amqp_set_memory_mode(). */
+typedef struct amqp_mapped_allocator_t_ {
+  amqp_allocator_t allocator; /* its context points back here */
+  amqp_allocator_t const *fallback; /* for small blocks */
+  int flags; /* AMQP_MEMORY_* requested */
+  int achieved; /* ... and honoured for every mapping so far */
+  amqp_mapped_region_t *current;
+} amqp_mapped_allocator_t;
+
+extern int amqp_mapped_allocator_init(amqp_mapped_allocator_t *m,
+				      amqp_allocator_t const *fallback,
+				      int flags);
+extern void amqp_mapped_allocator_destroy(amqp_mapped_allocator_t *m);
+
+/* A page or large block taken out of a pool by amqp_pool_detach(). */
+typedef struct amqp_pool_detached_t_ {
+  void *block;
+  amqp_allocator_t const *allocator; /* that block came from */
+  size_t pagesize; /* of the pool, if block is a page; 0 for a large block */
+} amqp_pool_detached_t;
+
+extern int amqp_pool_detach(amqp_pool_t *pool, void *ptr, amqp_pool_detached_t *detached);
+extern void amqp_pool_reattach(amqp_pool_t *pool, amqp_pool_detached_t const *detached);
+extern void amqp_pool_free_detached(amqp_pool_detached_t const *detached);
+
 extern char *amqp_os_error_string(int err);
 
 /*
@@ -140,6 +214,40 @@ typedef struct amqp_link_t_ {
   void *data;
 } amqp_link_t;
 
+/*
+ * A socket buffer that retained bodies were decoded in; see
+ * amqp_retain_body(). The connection holds a reference while it still
+ * uses the buffer, and is then on its list of shared socket buffers;
+ * every retained body holds another. The last one frees the buffer.
+ */
+typedef struct amqp_shared_sock_buffer_t_ {
+  int refcount;
+  amqp_bytes_t bytes;
+  amqp_allocator_t const *allocator; /* for bytes and the record itself */
+  struct amqp_shared_sock_buffer_t_ *next;
+} amqp_shared_sock_buffer_t;
+
+/*
+ * A body fragment retained past the recycling of the frame pool; see
+ * amqp_retain_body(). While its connection lives, the buffer is on
+ * the connection's list of retained buffers, and its memory goes back
+ * to the frame pool when the last reference is dropped. Buffers left
+ * over when the connection is destroyed are orphaned: state is
+ * cleared and the memory is simply freed in the end.
+ */
+struct amqp_buffer_t_ {
+  int refcount;
+  amqp_bytes_t bytes;
+  int pooled; /* 1 if bytes lie in detached, 0 if in sock_buffer or copy */
+  amqp_pool_detached_t detached;
+  amqp_shared_sock_buffer_t *sock_buffer;
+  void *copy;
+  amqp_allocator_t const *allocator; /* for copy and the buffer itself */
+  amqp_connection_state_t state;
+  struct amqp_buffer_t_ *prev;
+  struct amqp_buffer_t_ *next;
+};
+
 struct amqp_connection_state_t_ {
   amqp_pool_t frame_pool;
   amqp_pool_t decoding_pool;
@@ -156,71 +264,324 @@ struct amqp_connection_state_t_ {
 
   amqp_bytes_t outbound_buffer;
 
+  /* Frames coalesced by amqp_send_frame; see amqp_set_write_coalescing(). */
+  amqp_bytes_t pending_output; /* len is the capacity */
+  size_t pending_output_len;
+  uint64_t pending_output_since; /* amqp_monotonic_usec() of the oldest frame */
+  int flush_delay_usec;
+
+  amqp_allocator_t const *allocator; /* for the connection itself */
+  amqp_allocator_t const *buffer_allocator; /* for its pools and buffers */
+  int memory_mode;
+  amqp_mapped_allocator_t mapped_allocator;
+
   int sockfd;
   amqp_bytes_t sock_inbound_buffer;
   size_t sock_inbound_offset;
   size_t sock_inbound_limit;
 
+  /*
+   * Frames are decoded where they lie in sock_inbound_buffer, which
+   * pins everything before sock_inbound_offset until the frames are
+   * released. A partial frame at the end of the buffer is left there
+   * for the next recv to complete. When the buffer must be replaced
+   * while pinned, it is set aside in retired_sock_buffers; see
+   * amqp_fill_sock_inbound_buffer(). A buffer that bodies have been
+   * retained from is never reused, and only freed once they are gone.
+   */
+  int sock_inbound_pinned;
+  amqp_bytes_t *retired_sock_buffers;
+  int num_retired_sock_buffers;
+  int max_retired_sock_buffers;
+  amqp_bytes_t spare_sock_buffer;
+  amqp_shared_sock_buffer_t *shared_sock_buffers;
+  int sock_inbound_full_reads; /* in a row; for resizing the buffer */
+  int sock_inbound_small_reads;
+
   amqp_link_t *first_queued_frame;
   amqp_link_t *last_queued_frame;
 
+  amqp_buffer_t *retained_buffers;
+  amqp_buffer_t *spare_buffers; /* released, linked through next */
+
   amqp_rpc_reply_t most_recent_api_result;
+  int last_error; /* see amqp_get_connection_error() */
 };
 
-extern void    *buf_at(amqp_bytes_t bytes,
-		               int          offset);
-
-extern int      check_limit(amqp_bytes_t bytes,
-		                    int          offset,
-		                    int          length);
-
-extern uint8_t  d_8_helper(amqp_bytes_t bytes,
-		                   uint16_t     offset);
-extern uint16_t d_16_helper(amqp_bytes_t bytes,
-		                    uint16_t     offset);
-extern uint32_t d_32_helper(amqp_bytes_t bytes,
-		                    uint16_t     offset);
-extern uint64_t d_64_helper(amqp_bytes_t bytes,
-		                    uint16_t     offset);
-
-extern uint8_t  amqp_d8(amqp_bytes_t bytes,
-		                uint16_t     offset);
-extern uint16_t amqp_d16(amqp_bytes_t bytes,
-		                 uint16_t     offset);
-extern uint32_t amqp_d32(amqp_bytes_t bytes,
-		                 uint16_t     offset);
-extern uint64_t amqp_d64(amqp_bytes_t bytes,
-		                 uint16_t     offset);
-
-extern void     e_8_helper(amqp_bytes_t bytes, uint16_t offset, uint8_t value);
-extern void     e_16_helper(amqp_bytes_t bytes, uint16_t offset, uint16_t value);
-extern void     e_32_helper(amqp_bytes_t bytes, uint16_t offset, uint32_t value);
-
-extern int64_t  amqp_e8(amqp_bytes_t bytes, uint16_t offset, uint8_t value);
-extern int64_t  amqp_e16(amqp_bytes_t bytes, uint16_t offset, uint16_t value);
-extern int64_t  amqp_e32(amqp_bytes_t bytes, uint16_t offset, uint32_t value);
-extern int64_t  amqp_e64(amqp_bytes_t bytes, uint16_t offset, uint64_t value);
-
-extern uint8_t *amqp_dbytes(amqp_bytes_t bytes,
-		                    uint16_t     offset,
-		                    uint16_t     len);
-
-extern int64_t  amqp_ebytes(amqp_bytes_t  bytes,
-		                    uint16_t      offset,
-		                    uint16_t      len,
-		                    uint64_t     *pvalue);
+extern int amqp_handle_sock_input(amqp_connection_state_t state,
+				  amqp_frame_t *decoded_frame);
+extern int amqp_fill_sock_inbound_buffer(amqp_connection_state_t state);
+extern int amqp_flush_if_due(amqp_connection_state_t state);
+extern int amqp_send_message(amqp_connection_state_t state,
+			     amqp_frame_t const *frames,
+			     int num_frames,
+			     amqp_channel_t channel,
+			     amqp_bytes_t const *body,
+			     int num_segments);
+
+/* Fills in frames[0] and frames[1], the method and content header
+   frames of message i of an amqp_send_messages batch, and its body. */
+typedef void (*amqp_message_source_t)(void *context,
+				      size_t i,
+				      amqp_frame_t *frames,
+				      amqp_bytes_t *body);
+extern int amqp_send_messages(amqp_connection_state_t state,
+			      amqp_channel_t channel,
+			      size_t num_messages,
+			      amqp_message_source_t source,
+			      void *context,
+			      int *status);
+
+/* Records a negative result as the connection's (and the calling
+   thread's) last error, and passes the result through. */
+static inline int amqp_connection_error(amqp_connection_state_t state, int result)
+{
+  if (result < 0) {
+    state->last_error = -result;
+    amqp_set_error(-result);
+  }
+  return result;
+}
+
+/*
+ * Wire codec. The *_helper functions read and write big-endian
+ * values with no checks at all: callers validate the whole region
+ * they are about to touch once, up front, with check_limit(). The
+ * amqp_d* and amqp_e* wrappers check each access on their own and
+ * log failures, for code where speed does not matter.
+ */
+
+#if defined( __GNUC__ )
+#define amqp_unlikely(x) __builtin_expect(!!(x), 0)
+#else
+#define amqp_unlikely(x) (x)
+#endif
+
+#if defined( __GNUC__ ) && defined( __BYTE_ORDER__ ) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define AMQP_NTOH16(x) ((uint16_t) (((x) >> 8) | ((x) << 8)))
+#define AMQP_NTOH32(x) __builtin_bswap32(x)
+#define AMQP_NTOH64(x) __builtin_bswap64(x)
+#elif defined( __GNUC__ ) && defined( __BYTE_ORDER__ ) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define AMQP_NTOH16(x) (x)
+#define AMQP_NTOH32(x) (x)
+#define AMQP_NTOH64(x) (x)
+#elif defined( _MSC_VER )
+#define AMQP_NTOH16(x) _byteswap_ushort(x)
+#define AMQP_NTOH32(x) _byteswap_ulong(x)
+#define AMQP_NTOH64(x) _byteswap_uint64(x)
+#endif
+/* Otherwise values are assembled a byte at a time. */
+
+static inline void *buf_at(amqp_bytes_t bytes, size_t offset)
+{
+  return &((uint8_t *) bytes.bytes)[offset];
+}
 
+static inline int check_limit(amqp_bytes_t bytes, size_t offset, size_t length)
+{
+  if (amqp_unlikely(offset > bytes.len || length > bytes.len - offset)) {
+    amqp_set_error(ERROR_BAD_AMQP_DATA);
+    return -ERROR_BAD_AMQP_DATA;
+  }
+  return 0;
+}
+
+static inline uint8_t d_8_helper(amqp_bytes_t bytes, size_t offset)
+{
+  return * (uint8_t *) buf_at(bytes, offset);
+}
+
+static inline uint16_t d_16_helper(amqp_bytes_t bytes, size_t offset)
+{
+#if defined( AMQP_NTOH16 )
+  uint16_t value;
+  memcpy(&value, buf_at(bytes, offset), 2);
+  return AMQP_NTOH16(value);
+#else
+  uint8_t const *p = buf_at(bytes, offset);
+  return (uint16_t) ((p[0] << 8) | p[1]);
+#endif
+}
+
+static inline uint32_t d_32_helper(amqp_bytes_t bytes, size_t offset)
+{
+#if defined( AMQP_NTOH32 )
+  uint32_t value;
+  memcpy(&value, buf_at(bytes, offset), 4);
+  return AMQP_NTOH32(value);
+#else
+  uint8_t const *p = buf_at(bytes, offset);
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+#endif
+}
+
+static inline uint64_t d_64_helper(amqp_bytes_t bytes, size_t offset)
+{
+#if defined( AMQP_NTOH64 )
+  uint64_t value;
+  memcpy(&value, buf_at(bytes, offset), 8);
+  return AMQP_NTOH64(value);
+#else
+  return ((uint64_t) d_32_helper(bytes, offset) << 32) | d_32_helper(bytes, offset + 4);
+#endif
+}
+
+static inline void e_8_helper(amqp_bytes_t bytes, size_t offset, uint8_t value)
+{
+  * (uint8_t *) buf_at(bytes, offset) = value;
+}
+
+static inline void e_16_helper(amqp_bytes_t bytes, size_t offset, uint16_t value)
+{
+#if defined( AMQP_NTOH16 )
+  value = AMQP_NTOH16(value);
+  memcpy(buf_at(bytes, offset), &value, 2);
+#else
+  uint8_t *p = buf_at(bytes, offset);
+  p[0] = (uint8_t) (value >> 8);
+  p[1] = (uint8_t) value;
+#endif
+}
+
+static inline void e_32_helper(amqp_bytes_t bytes, size_t offset, uint32_t value)
+{
+#if defined( AMQP_NTOH32 )
+  value = AMQP_NTOH32(value);
+  memcpy(buf_at(bytes, offset), &value, 4);
+#else
+  uint8_t *p = buf_at(bytes, offset);
+  p[0] = (uint8_t) (value >> 24);
+  p[1] = (uint8_t) (value >> 16);
+  p[2] = (uint8_t) (value >> 8);
+  p[3] = (uint8_t) value;
+#endif
+}
+
+static inline void e_64_helper(amqp_bytes_t bytes, size_t offset, uint64_t value)
+{
+#if defined( AMQP_NTOH64 )
+  value = AMQP_NTOH64(value);
+  memcpy(buf_at(bytes, offset), &value, 8);
+#else
+  e_32_helper(bytes, offset, (uint32_t) (value >> 32));
+  e_32_helper(bytes, offset + 4, (uint32_t) value);
+#endif
+}
+
+#define AMQP_CODEC_OUT_OF_BOUNDS(offset)				\
+  amqp_log_error(__FILE__, __LINE__, LOG_CRIT, ERROR_LIMIT_OUT_OF_BOUNDS, \
+		 "Offset = %lu.", (unsigned long) (offset))
+
+static inline uint8_t amqp_d8(amqp_bytes_t bytes, size_t offset)
+{
+  if (check_limit(bytes, offset, 1) < 0) {
+    AMQP_CODEC_OUT_OF_BOUNDS(offset);
+    return 0;
+  }
+  return d_8_helper(bytes, offset);
+}
+
+static inline uint16_t amqp_d16(amqp_bytes_t bytes, size_t offset)
+{
+  if (check_limit(bytes, offset, 2) < 0) {
+    AMQP_CODEC_OUT_OF_BOUNDS(offset);
+    return 0;
+  }
+  return d_16_helper(bytes, offset);
+}
+
+static inline uint32_t amqp_d32(amqp_bytes_t bytes, size_t offset)
+{
+  if (check_limit(bytes, offset, 4) < 0) {
+    AMQP_CODEC_OUT_OF_BOUNDS(offset);
+    return 0;
+  }
+  return d_32_helper(bytes, offset);
+}
+
+static inline uint64_t amqp_d64(amqp_bytes_t bytes, size_t offset)
+{
+  if (check_limit(bytes, offset, 8) < 0) {
+    AMQP_CODEC_OUT_OF_BOUNDS(offset);
+    return 0;
+  }
+  return d_64_helper(bytes, offset);
+}
+
+static inline uint8_t *amqp_dbytes(amqp_bytes_t bytes, size_t offset, size_t len)
+{
+  if (check_limit(bytes, offset, len) < 0) {
+    AMQP_CODEC_OUT_OF_BOUNDS(offset);
+    return NULL;
+  }
+  return buf_at(bytes, offset);
+}
+
+static inline int64_t amqp_e8(amqp_bytes_t bytes, size_t offset, uint8_t value)
+{
+  int check = check_limit(bytes, offset, 1);
+  if (check < 0) {
+    AMQP_CODEC_OUT_OF_BOUNDS(offset);
+    return check;
+  }
+  e_8_helper(bytes, offset, value);
+  return 0;
+}
+
+static inline int64_t amqp_e16(amqp_bytes_t bytes, size_t offset, uint16_t value)
+{
+  int check = check_limit(bytes, offset, 2);
+  if (check < 0) {
+    AMQP_CODEC_OUT_OF_BOUNDS(offset);
+    return check;
+  }
+  e_16_helper(bytes, offset, value);
+  return 0;
+}
+
+static inline int64_t amqp_e32(amqp_bytes_t bytes, size_t offset, uint32_t value)
+{
+  int check = check_limit(bytes, offset, 4);
+  if (check < 0) {
+    AMQP_CODEC_OUT_OF_BOUNDS(offset);
+    return check;
+  }
+  e_32_helper(bytes, offset, value);
+  return 0;
+}
+
+static inline int64_t amqp_e64(amqp_bytes_t bytes, size_t offset, uint64_t value)
+{
+  int check = check_limit(bytes, offset, 8);
+  if (check < 0) {
+    AMQP_CODEC_OUT_OF_BOUNDS(offset);
+    return check;
+  }
+  e_64_helper(bytes, offset, value);
+  return 0;
+}
+
+static inline int64_t amqp_ebytes(amqp_bytes_t bytes, size_t offset, size_t len, void const *src)
+{
+  int check = check_limit(bytes, offset, len);
+  if (check < 0) {
+    AMQP_CODEC_OUT_OF_BOUNDS(offset);
+    return check;
+  }
+  memcpy(buf_at(bytes, offset), src, len);
+  return 0;
+}
 
 /***  END OF REWRITE SECTION *** - frgo, 2010-08-24 */
 
 extern int amqp_decode_table(amqp_bytes_t   encoded,
 			                 amqp_pool_t   *pool,
 			                 amqp_table_t  *output,
-			                 int           *offsetptr);
+			                 size_t        *offsetptr);
 
 extern int amqp_encode_table(amqp_bytes_t encoded,
 			     amqp_table_t *input,
-			     int *offsetptr);
+			     size_t *offsetptr);
 
 void amqp_assert( int nCondition, char *pcFormat, ...);
 
@@ -183,54 +183,135 @@ amqp_boolean_t amqp_data_in_buffer(amqp_connection_state_t state) {
 static int wait_frame_inner(amqp_connection_state_t state,
 			    amqp_frame_t *decoded_frame)
 {
+  int result = amqp_flush_if_due(state);
+  if (result < 0)
+    return result;
+
   while (1) {
-    int result;
 
     while (amqp_data_in_buffer(state)) {
-      amqp_bytes_t buffer;
-      buffer.len = state->sock_inbound_limit - state->sock_inbound_offset;
-      buffer.bytes = ((char *) state->sock_inbound_buffer.bytes) + state->sock_inbound_offset;
-      result = amqp_handle_input(state, buffer, decoded_frame);
+      result = amqp_handle_sock_input(state, decoded_frame);
       if( result < 0)
         return result;
-      state->sock_inbound_offset += result;
 
       if (decoded_frame->frame_type != 0)
 	/* Complete frame was read. Return it. */
 	return 0;
 
-      /* Incomplete or ignored frame. Keep processing input. */
-      assert(result != 0);
+      if (result == 0)
+	/* The rest of a partial frame is still to come. */
+	break;
+
+      /* Ignored frame. Keep processing input. */
     }	
 
-    result = recv(state->sockfd, state->sock_inbound_buffer.bytes,
-		  state->sock_inbound_buffer.len, 0);
-    if (result <= 0) {
-      if (result == 0)
-	return -ERROR_CONNECTION_CLOSED;
-      else
-	return -amqp_socket_error();
-    }
+    result = amqp_fill_sock_inbound_buffer(state);
+    if (result < 0)
+      return result;
+  }
+}
 
-    state->sock_inbound_limit = result;
-    state->sock_inbound_offset = 0;
+static void dequeue_frame(amqp_connection_state_t state,
+			  amqp_frame_t *decoded_frame)
+{
+  amqp_frame_t *f = (amqp_frame_t *) state->first_queued_frame->data;
+  state->first_queued_frame = state->first_queued_frame->next;
+  if (state->first_queued_frame == NULL) {
+    state->last_queued_frame = NULL;
   }
+  *decoded_frame = *f;
 }
 
 int amqp_simple_wait_frame(amqp_connection_state_t state,
 			   amqp_frame_t *decoded_frame)
 {
   if (state->first_queued_frame != NULL) {
-    amqp_frame_t *f = (amqp_frame_t *) state->first_queued_frame->data;
-    state->first_queued_frame = state->first_queued_frame->next;
-    if (state->first_queued_frame == NULL) {
-      state->last_queued_frame = NULL;
-    }
-    *decoded_frame = *f;
+    dequeue_frame(state, decoded_frame);
     return 0;
   } else {
-    return wait_frame_inner(state, decoded_frame);
+    return amqp_connection_error(state, wait_frame_inner(state, decoded_frame));
+  }
+}
+
+/*
+ * Moves every complete frame left in the socket buffer into frames,
+ * up to max of them in all. A bad frame is only reported once the
+ * frames before it have been handed back.
+ */
+static int drain_sock_input(amqp_connection_state_t state,
+			    amqp_frame_t *frames,
+			    int count,
+			    int max)
+{
+  while (count < max && amqp_data_in_buffer(state)) {
+    int result = amqp_handle_sock_input(state, &frames[count]);
+    if (result < 0)
+      return count > 0 ? count : result;
+    if (frames[count].frame_type != 0)
+      count++;
+    else if (result == 0)
+      break;
   }
+  return count;
+}
+
+static int wait_frames_inner(amqp_connection_state_t state,
+			     amqp_frame_t *frames,
+			     int max,
+			     struct timeval *timeout)
+{
+  int count = 0;
+  int result;
+
+  result = amqp_flush_if_due(state);
+  if (result < 0)
+    return result;
+
+  while (count < max && state->first_queued_frame != NULL) {
+    dequeue_frame(state, &frames[count++]);
+  }
+
+  count = drain_sock_input(state, frames, count, max);
+  if (count != 0 || max == 0)
+    return count;
+
+  if (timeout != NULL) {
+    fd_set readfds;
+
+    result = amqp_flush(state);
+    if (result < 0)
+      return result;
+
+    FD_ZERO(&readfds);
+    FD_SET(state->sockfd, &readfds);
+    result = select(state->sockfd + 1, &readfds, NULL, NULL, timeout);
+    if (result <= 0)
+      return result < 0 ? -amqp_socket_error() : 0;
+  }
+
+  result = amqp_fill_sock_inbound_buffer(state);
+  if (result < 0)
+    return result;
+
+  return drain_sock_input(state, frames, 0, max);
+}
+
+/*
+ * Hands back up to max frames at once: the queued ones, then every
+ * complete frame already received. Only if there are none does it
+ * read from the socket, once, waiting at most timeout for data to
+ * arrive (or for as long as it takes if timeout is NULL). Returns
+ * the number of frames, which is 0 if the time ran out or the read
+ * did not complete a frame, or a negative error code. The frames
+ * stay valid until the connection's buffers are released, as with
+ * amqp_simple_wait_frame.
+ */
+int amqp_wait_frames(amqp_connection_state_t state,
+		     amqp_frame_t *frames,
+		     int max,
+		     struct timeval *timeout)
+{
+  return amqp_connection_error(state, wait_frames_inner(state, frames, max, timeout));
 }
 
 int amqp_simple_wait_method(amqp_connection_state_t state,
@@ -58,228 +58,562 @@
 #include "amqp_private.h"
 #include "socket.h"
 
+/*
+ * UTF-8 validation skips ASCII with SSE2 or AVX2, and compact table
+ * lookups compare key lengths with SSE2, when the compiler targets
+ * them; plain loops are used otherwise.
+ */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define AMQP_TABLE_AVX2 1
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define AMQP_TABLE_SSE2 1
+#endif
 
-#define INITIAL_ARRAY_SIZE 16
-#define INITIAL_TABLE_SIZE 16
+#if defined(AMQP_TABLE_SSE2)
+/* Index of the lowest set bit of x, which is not 0. */
+#ifdef _MSC_VER
+#include <intrin.h>
+static unsigned amqp_ctz(unsigned x)
+{
+  unsigned long index;
+  _BitScanForward(&index, x);
+  return (unsigned) index;
+}
+#else
+#define amqp_ctz(x) ((unsigned) __builtin_ctz(x))
+#endif
+#endif
 
 static int amqp_decode_field_value(amqp_bytes_t encoded,
 				   amqp_pool_t *pool,
 				   amqp_field_value_t *entry,
-				   int *offsetptr); /* forward */
+				   size_t *offsetptr,
+				   int lazy); /* forward */
 
 static int amqp_encode_field_value(amqp_bytes_t encoded,
 				   amqp_field_value_t *entry,
-				   int *offsetptr); /* forward */
+				   size_t *offsetptr); /* forward */
 
 /*---------------------------------------------------------------------------*/
 
+/*
+ * An array or table is decoded in a single pass, straight into pool
+ * memory: its entries go into a pool block sized from the bytes the
+ * array or table declares, which is doubled within the pool in the
+ * rare case that turns out too small. Each part of an entry is checked
+ * against encoded.len just before it is read with the unchecked codec
+ * helpers. An array or table is decoded with encoded.len cut down to
+ * its end, so that its entries cannot stray past the size it declares.
+ */
+
+#define CHECK_LIMIT(encoded, offset, length)				\
+  if (check_limit((encoded), (offset), (length)) < 0) {		\
+    return -ERROR_BAD_AMQP_DATA;					\
+  }
+
+/* A lazy table's encoding, size prefix included. */
+static amqp_bytes_t amqp_table_raw_bytes(amqp_table_t const *table)
+{
+  amqp_bytes_t raw;
+  raw.bytes = table->entries;
+  raw.len = 4;
+  raw.len += d_32_helper(raw, 0);
+  return raw;
+}
+
+static int amqp_keys_equal(char const *a, char const *b, size_t len)
+{
+  return memcmp(a, b, len) == 0;
+}
+
+/*
+ * Length of the well-formed UTF-8 sequence starting at p, or 0 if
+ * there is none: overlong forms, surrogates and code points above
+ * U+10FFFF are rejected.
+ */
+static size_t amqp_utf8_sequence_length(unsigned char const *p, size_t avail)
+{
+  unsigned char c = p[0];
+  unsigned char lo = 0x80, hi = 0xBF;
+  size_t n, i;
+
+  if (c < 0x80)
+    return 1;
+  else if (c >= 0xC2 && c <= 0xDF)
+    n = 2;
+  else if (c >= 0xE0 && c <= 0xEF) {
+    n = 3;
+    if (c == 0xE0) lo = 0xA0;
+    if (c == 0xED) hi = 0x9F;
+  } else if (c >= 0xF0 && c <= 0xF4) {
+    n = 4;
+    if (c == 0xF0) lo = 0x90;
+    if (c == 0xF4) hi = 0x8F;
+  } else
+    return 0;
+
+  if (avail < n || p[1] < lo || p[1] > hi)
+    return 0;
+  for (i = 2; i < n; i++) {
+    if ((p[i] & 0xC0) != 0x80)
+      return 0;
+  }
+  return n;
+}
+
+amqp_boolean_t amqp_utf8_valid(amqp_bytes_t bytes)
+{
+  unsigned char const *p = bytes.bytes;
+  size_t i = 0;
+
+  while (i < bytes.len) {
+    size_t n;
+
+    /* Skip ASCII a block at a time, up to the next byte that is not. */
+#if defined(AMQP_TABLE_AVX2)
+    if (bytes.len - i >= 32) {
+      unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_loadu_si256((__m256i const *) (p + i)));
+      if (mask == 0) {
+	i += 32;
+	continue;
+      }
+      i += amqp_ctz(mask);
+    } else
+#endif
+#if defined(AMQP_TABLE_SSE2)
+    if (bytes.len - i >= 16) {
+      unsigned mask = (unsigned) _mm_movemask_epi8(_mm_loadu_si128((__m128i const *) (p + i)));
+      if (mask == 0) {
+	i += 16;
+	continue;
+      }
+      i += amqp_ctz(mask);
+    }
+#endif
+
+    n = amqp_utf8_sequence_length(p + i, bytes.len - i);
+    if (n == 0)
+      return 0;
+    i += n;
+  }
+  return 1;
+}
+
+static int amqp_skip_field_value(amqp_bytes_t encoded,
+				 size_t *offsetptr)
+{
+  size_t offset = *offsetptr;
+  size_t width  = 0;
+
+  CHECK_LIMIT(encoded, offset, 1);
+  switch (d_8_helper(encoded, offset++)) {
+    case AMQP_FIELD_KIND_BOOLEAN:
+    case AMQP_FIELD_KIND_I8:
+    case AMQP_FIELD_KIND_U8:
+      width = 1;
+      break;
+    case AMQP_FIELD_KIND_I16:
+    case AMQP_FIELD_KIND_U16:
+      width = 2;
+      break;
+    case AMQP_FIELD_KIND_I32:
+    case AMQP_FIELD_KIND_U32:
+    case AMQP_FIELD_KIND_F32:
+      width = 4;
+      break;
+    case AMQP_FIELD_KIND_I64:
+    case AMQP_FIELD_KIND_F64:
+    case AMQP_FIELD_KIND_TIMESTAMP:
+      width = 8;
+      break;
+    case AMQP_FIELD_KIND_DECIMAL:
+      width = 5;
+      break;
+    case AMQP_FIELD_KIND_UTF8:
+    case AMQP_FIELD_KIND_BYTES:
+    case AMQP_FIELD_KIND_ARRAY:
+    case AMQP_FIELD_KIND_TABLE:
+      CHECK_LIMIT(encoded, offset, 4);
+      width = d_32_helper(encoded, offset);
+      offset += 4;
+      break;
+    case AMQP_FIELD_KIND_VOID:
+      break;
+    default:
+      return -ERROR_BAD_AMQP_DATA;
+  }
+
+  CHECK_LIMIT(encoded, offset, width);
+  *offsetptr = offset + width;
+  return OK;
+}
+
+/*
+ * Wire bytes per entry assumed when sizing the first block of entries
+ * for an array or table; most are bigger, so the guess rarely needs
+ * doubling.
+ */
+#define ARRAY_ENTRY_BYTES_GUESS 8
+#define TABLE_ENTRY_BYTES_GUESS 16
+
+/*
+ * Doubles the pool block holding num entries of size bytes each. The
+ * old block is left to the pool, to go when it is recycled.
+ */
+static void *amqp_grow_entries(amqp_pool_t *pool,
+			       void *entries,
+			       int num_entries,
+			       int *allocated_entries,
+			       size_t size)
+{
+  void *grown = amqp_pool_alloc(pool, 2 * (size_t) *allocated_entries * size);
+
+  if (grown != NULL) {
+    memcpy(grown, entries, num_entries * size);
+    *allocated_entries *= 2;
+  }
+  return grown;
+}
+
 static int amqp_decode_array(amqp_bytes_t encoded,
 			     amqp_pool_t *pool,
 			     amqp_array_t *output,
-			     int *offsetptr)
+			     size_t *offsetptr)
 {
-  int                   offset            = *offsetptr;
+  size_t                offset            = *offsetptr;
   int                   check             = OK;
   uint32_t              arraysize         = 0;
   int                   num_entries       = 0;
-  int                   allocated_entries = INITIAL_ARRAY_SIZE;
-  int                   limit             = 0;
-  amqp_field_value_t   *entries           = NULL; 
+  int                   allocated_entries = 0;
+  amqp_field_value_t   *entries           = NULL;
 
-  arraysize = amqp_d32(encoded, offset);
-
-  if((check = amqp_get_error()) != OK)
-	return check;
-
-  entries = (amqp_field_value_t *) malloc(INITIAL_ARRAY_SIZE * sizeof(amqp_field_value_t));
+  CHECK_LIMIT(encoded, offset, 4);
+  arraysize = d_32_helper(encoded, offset);
+  offset += 4;
+  CHECK_LIMIT(encoded, offset, arraysize);
+  encoded.len = offset + arraysize;
 
-  if (entries == NULL) {
-    return -ERROR_NO_MEMORY;
+  if (arraysize > 0) {
+    allocated_entries = arraysize / ARRAY_ENTRY_BYTES_GUESS + 1;
+    entries = amqp_pool_alloc(pool, allocated_entries * sizeof(amqp_field_value_t));
+    if (entries == NULL)
+      return -ERROR_NO_MEMORY;
   }
 
-  offset += 4;
-  limit = offset + arraysize;
-
-  while (offset < limit) {
-    if (num_entries >= allocated_entries) {
-      void *newentries;
-      allocated_entries = allocated_entries * 2;
-      newentries = realloc(entries, allocated_entries * sizeof(amqp_field_value_t));
-      if (newentries == NULL) {
-	free(entries);
+  while (offset < encoded.len) {
+    if (num_entries == allocated_entries) {
+      entries = amqp_grow_entries(pool, entries, num_entries, &allocated_entries,
+				  sizeof(amqp_field_value_t));
+      if (entries == NULL)
 	return -ERROR_NO_MEMORY;
-      }
-      entries = newentries;
     }
 
-    check = amqp_decode_field_value(encoded,
-						            pool,
-						            &entries[num_entries],
-						            &offset);
-    if( check < 0)
-    {
-      free(entries);
+    check = amqp_decode_field_value(encoded, pool, &entries[num_entries], &offset, 0);
+    if (check < 0)
       return check;
-    }
     num_entries++;
   }
 
   output->num_entries = num_entries;
-  output->entries = amqp_pool_alloc(pool, num_entries * sizeof(amqp_field_value_t));
-  if (output->entries == NULL && num_entries > 0) {
-    /* NULL is legitimate if we requested a zero-length block. */
-    free(entries);
-    return -ERROR_NO_MEMORY;
-  }
-
-  memcpy(output->entries, entries, num_entries * sizeof(amqp_field_value_t));
-  free(entries);
+  output->entries = entries;
 
   *offsetptr = offset;
   return 0;
 }
 
-int amqp_decode_table(amqp_bytes_t encoded,
-		      amqp_pool_t *pool,
-		      amqp_table_t *output,
-		      int *offsetptr)
+/*
+ * Counts the entries of a table, which run from offset to the end of
+ * encoded, checking their extent. Also totals the key bytes if asked.
+ */
+static int amqp_count_table_entries(amqp_bytes_t encoded,
+				    size_t offset,
+				    int *num_entries,
+				    size_t *key_bytes)
 {
-  int      offset            = *offsetptr;
-  uint32_t tablesize         = 0;
-  int      check             = OK;
-  int      num_entries       = 0;
-  int      limit             = 0;
-  int      allocated_entries = INITIAL_TABLE_SIZE;
+  int    count = 0;
+  size_t total = 0;
+  int    check;
 
-  amqp_table_entry_t *entries = malloc(INITIAL_TABLE_SIZE * sizeof(amqp_table_entry_t));
+  while (offset < encoded.len) {
+    size_t keylen = d_8_helper(encoded, offset);
+    offset++;
+    CHECK_LIMIT(encoded, offset, keylen);
+    offset += keylen;
+    total += keylen;
 
-  if (entries == NULL) {
-    return -ERROR_NO_MEMORY;
+    check = amqp_skip_field_value(encoded, &offset);
+    if (check < 0)
+      return check;
+    count++;
   }
 
-  tablesize = amqp_d32(encoded, offset);
+  *num_entries = count;
+  if (key_bytes != NULL)
+    *key_bytes = total;
+  return OK;
+}
 
-  if((check = amqp_get_error()) !=  OK)
-	return check;
+static int amqp_key_cmp(amqp_bytes_t a, amqp_bytes_t b)
+{
+  int d = memcmp(a.bytes, b.bytes, a.len < b.len ? a.len : b.len);
+  if (d != 0)
+    return d;
+  return (int) a.len - (int) b.len;
+}
 
-  offset += 4;
-  limit = offset + tablesize;
+/*
+ * Sorts entries in the order of amqp_table_entry_cmp. Quicksort down to
+ * short runs, which are then finished by one insertion sort pass; the
+ * comparison is inlined, which qsort() cannot do, and already sorted
+ * input costs a single pass.
+ */
+static void amqp_sort_table_entries(amqp_table_entry_t *entries, int num_entries)
+{
+  amqp_table_entry_t tmp;
+  int stack[64];
+  int depth = 0;
+  int lo = 0;
+  int hi = num_entries - 1;
+  int i, j;
 
-  while (offset < limit)
-  {
-    size_t              keylen = 0;
-    amqp_table_entry_t *entry  = NULL;
+  for (;;) {
+    while (hi - lo > 12) {
+      amqp_table_entry_t *mid = &entries[lo + (hi - lo) / 2];
+      amqp_bytes_t pivot;
 
-    keylen = amqp_d8(encoded, offset);
-    if((check = amqp_get_error()) !=  OK)
-  	  return check;
+      /* median of three, left at entries[lo] */
+      if (amqp_key_cmp(mid->key, entries[lo].key) < 0) {
+	tmp = *mid; *mid = entries[lo]; entries[lo] = tmp;
+      }
+      if (amqp_key_cmp(entries[hi].key, mid->key) < 0) {
+	tmp = entries[hi]; entries[hi] = *mid; *mid = tmp;
+	if (amqp_key_cmp(mid->key, entries[lo].key) < 0) {
+	  tmp = *mid; *mid = entries[lo]; entries[lo] = tmp;
+	}
+      }
+      tmp = *mid; *mid = entries[lo]; entries[lo] = tmp;
+      pivot = entries[lo].key;
 
-    offset++;
+      i = lo;
+      j = hi + 1;
+      for (;;) {
+	while (amqp_key_cmp(entries[++i].key, pivot) < 0 && i < hi)
+	  ;
+	while (amqp_key_cmp(pivot, entries[--j].key) < 0)
+	  ;
+	if (i >= j)
+	  break;
+	tmp = entries[i]; entries[i] = entries[j]; entries[j] = tmp;
+      }
+      tmp = entries[lo]; entries[lo] = entries[j]; entries[j] = tmp;
 
-    if (num_entries >= allocated_entries) {
-      void *newentries;
-      allocated_entries = allocated_entries * 2;
-      newentries = realloc(entries, allocated_entries * sizeof(amqp_table_entry_t));
-      if (newentries == NULL)
-      {
-	    free(entries);
-	    return -ERROR_NO_MEMORY;
+      /* recurse into the smaller side, so the stack stays logarithmic */
+      if (j - lo < hi - j) {
+	stack[depth++] = j + 1;
+	stack[depth++] = hi;
+	hi = j - 1;
+      } else {
+	stack[depth++] = lo;
+	stack[depth++] = j - 1;
+	lo = j + 1;
       }
-      entries = newentries;
+    }
+    if (depth == 0)
+      break;
+    hi = stack[--depth];
+    lo = stack[--depth];
+  }
+
+  for (i = 1; i < num_entries; i++) {
+    if (amqp_key_cmp(entries[i - 1].key, entries[i].key) <= 0)
+      continue;
+    tmp = entries[i];
+    for (j = i; j > 0 && amqp_key_cmp(tmp.key, entries[j - 1].key) < 0; j--)
+      entries[j] = entries[j - 1];
+    entries[j] = tmp;
+  }
+}
+
+static int amqp_decode_table_eager(amqp_bytes_t encoded,
+				   amqp_pool_t *pool,
+				   amqp_table_t *output,
+				   size_t *offsetptr)
+{
+  size_t   offset            = *offsetptr;
+  uint32_t tablesize         = 0;
+  int      check             = OK;
+  int      num_entries       = 0;
+  int      allocated_entries = 0;
+  amqp_table_entry_t *entries = NULL;
+
+  CHECK_LIMIT(encoded, offset, 4);
+  tablesize = d_32_helper(encoded, offset);
+  offset += 4;
+  CHECK_LIMIT(encoded, offset, tablesize);
+  encoded.len = offset + tablesize;
+
+  if (tablesize > 0) {
+    allocated_entries = tablesize / TABLE_ENTRY_BYTES_GUESS + 1;
+    entries = amqp_pool_alloc(pool, allocated_entries * sizeof(amqp_table_entry_t));
+    if (entries == NULL)
+      return -ERROR_NO_MEMORY;
+  }
+
+  while (offset < encoded.len) {
+    amqp_table_entry_t *entry;
+    size_t keylen;
+
+    if (num_entries == allocated_entries) {
+      entries = amqp_grow_entries(pool, entries, num_entries, &allocated_entries,
+				  sizeof(amqp_table_entry_t));
+      if (entries == NULL)
+	return -ERROR_NO_MEMORY;
     }
     entry = &entries[num_entries];
 
+    keylen = d_8_helper(encoded, offset);
+    offset++;
+    CHECK_LIMIT(encoded, offset, keylen);
     entry->key.len    = keylen;
-    entry->key.bytes  = amqp_dbytes(encoded, offset, keylen);
+    entry->key.bytes  = buf_at(encoded, offset);
     offset           += keylen;
 
-    check = amqp_decode_field_value(encoded,
-						            pool,
-						            &entry->value,
-						            &offset);
-    if( check < 0 )
-    {
-      free(entries);
+    check = amqp_decode_field_value(encoded, pool, &entry->value, &offset, 0);
+    if (check < 0)
       return check;
-    }
     num_entries++;
   }
 
-  output->num_entries = num_entries;
-  output->entries = amqp_pool_alloc(pool, num_entries * sizeof(amqp_table_entry_t));
-
-  if (output->entries == NULL && num_entries > 0)
-  {
-    /* NULL is legitimate if we requested a zero-length block. */
-    free(entries);
-    return -ERROR_NO_MEMORY;
+  if (pool->flags & AMQP_POOL_SORTED_TABLES) {
+    amqp_sort_table_entries(entries, num_entries);
   }
 
-  memcpy(output->entries, entries, num_entries * sizeof(amqp_table_entry_t));
-  free(entries);
+  output->num_entries = num_entries;
+  output->entries = entries;
 
   *offsetptr = offset;
   return 0;
 }
 
+/*
+ * A lazy table is only checked against the size it declares, and is
+ * left in place; see AMQP_TABLE_LAZY.
+ */
+static int amqp_decode_table_lazy(amqp_bytes_t encoded,
+				  amqp_table_t *output,
+				  size_t *offsetptr)
+{
+  size_t   offset    = *offsetptr;
+  uint32_t tablesize = 0;
+
+  CHECK_LIMIT(encoded, offset, 4);
+  tablesize = d_32_helper(encoded, offset);
+  CHECK_LIMIT(encoded, offset + 4, tablesize);
+
+  output->num_entries = AMQP_TABLE_LAZY;
+  output->entries = buf_at(encoded, offset);
+
+  *offsetptr = offset + 4 + tablesize;
+  return 0;
+}
+
+int amqp_decode_table(amqp_bytes_t encoded,
+		      amqp_pool_t *pool,
+		      amqp_table_t *output,
+		      size_t *offsetptr)
+{
+  if (pool->flags & AMQP_POOL_LAZY_TABLES) {
+    return amqp_decode_table_lazy(encoded, output, offsetptr);
+  }
+  return amqp_decode_table_eager(encoded, pool, output, offsetptr);
+}
+
+/*
+ * Checks the extent of each part of the value just before reading it.
+ * Nested tables are left lazy if lazy is set, and decoded in full
+ * otherwise.
+ */
+
+#define DECODE_LIMIT(length)						\
+  if (check_limit(encoded, offset, (length)) < 0) {			\
+    check = -ERROR_BAD_AMQP_DATA;					\
+    break;								\
+  }
+
 static int amqp_decode_field_value(amqp_bytes_t encoded,
 				   amqp_pool_t *pool,
 				   amqp_field_value_t *entry,
-				   int *offsetptr)
+				   size_t *offsetptr,
+				   int lazy)
 {
-  int     offset = *offsetptr;
-  int64_t check  = 0;
+  size_t offset = *offsetptr;
+  int check  = OK;
 
-  entry->kind = amqp_d8(encoded, offset);
+  CHECK_LIMIT(encoded, offset, 1);
+  entry->kind = d_8_helper(encoded, offset);
   offset++;
 
   switch (entry->kind) {
     case AMQP_FIELD_KIND_BOOLEAN:
-      entry->value.boolean = amqp_d8(encoded, offset) ? 1 : 0;
+      DECODE_LIMIT(1);
+      entry->value.boolean = d_8_helper(encoded, offset) ? 1 : 0;
       offset++;
       break;
     case AMQP_FIELD_KIND_I8:
-      entry->value.i8 = (int8_t) amqp_d8(encoded, offset);
+      DECODE_LIMIT(1);
+      entry->value.i8 = (int8_t) d_8_helper(encoded, offset);
       offset++;
       break;
     case AMQP_FIELD_KIND_U8:
-      entry->value.u8 = amqp_d8(encoded, offset);
+      DECODE_LIMIT(1);
+      entry->value.u8 = d_8_helper(encoded, offset);
       offset++;
       break;
     case AMQP_FIELD_KIND_I16:
-      entry->value.i16 = (int16_t) amqp_d16(encoded, offset);
+      DECODE_LIMIT(2);
+      entry->value.i16 = (int16_t) d_16_helper(encoded, offset);
       offset += 2;
       break;
     case AMQP_FIELD_KIND_U16:
-      entry->value.u16 = amqp_d16(encoded, offset);
+      DECODE_LIMIT(2);
+      entry->value.u16 = d_16_helper(encoded, offset);
       offset += 2;
       break;
     case AMQP_FIELD_KIND_I32:
-      entry->value.i32 = (int32_t) amqp_d32(encoded, offset);
+      DECODE_LIMIT(4);
+      entry->value.i32 = (int32_t) d_32_helper(encoded, offset);
       offset += 4;
       break;
     case AMQP_FIELD_KIND_U32:
-      entry->value.u32 = amqp_d32(encoded, offset);
+      DECODE_LIMIT(4);
+      entry->value.u32 = d_32_helper(encoded, offset);
       offset += 4;
       break;
     case AMQP_FIELD_KIND_I64:
-      entry->value.i64 = (int64_t) amqp_d64(encoded, offset);
+      DECODE_LIMIT(8);
+      entry->value.i64 = (int64_t) d_64_helper(encoded, offset);
       offset += 8;
       break;
     case AMQP_FIELD_KIND_F32:
-      entry->value.u32 = amqp_d32(encoded, offset);
+      DECODE_LIMIT(4);
+      entry->value.u32 = d_32_helper(encoded, offset);
       /* and by punning, f32 magically gets the right value...! */
       offset += 4;
       break;
     case AMQP_FIELD_KIND_F64:
-      entry->value.u64 = amqp_d64(encoded, offset);
+      DECODE_LIMIT(8);
+      entry->value.u64 = d_64_helper(encoded, offset);
       /* and by punning, f64 magically gets the right value...! */
       offset += 8;
       break;
     case AMQP_FIELD_KIND_DECIMAL:
-      entry->value.decimal.decimals = amqp_d8(encoded, offset);
+      DECODE_LIMIT(5);
+      entry->value.decimal.decimals = d_8_helper(encoded, offset);
       offset++;
-      entry->value.decimal.value = amqp_d32(encoded, offset);
+      entry->value.decimal.value = d_32_helper(encoded, offset);
       offset += 4;
       break;
     case AMQP_FIELD_KIND_UTF8:
@@ -287,20 +621,33 @@ static int amqp_decode_field_value(amqp_bytes_t encoded,
 	 same implementation, but different interpretations. */
       /* fall through */
     case AMQP_FIELD_KIND_BYTES:
-      entry->value.bytes.len = amqp_d32(encoded, offset);
+      DECODE_LIMIT(4);
+      entry->value.bytes.len = d_32_helper(encoded, offset);
       offset += 4;
-      entry->value.bytes.bytes = amqp_dbytes(encoded, offset, entry->value.bytes.len);
+      DECODE_LIMIT(entry->value.bytes.len);
+      entry->value.bytes.bytes = buf_at(encoded, offset);
       offset += entry->value.bytes.len;
+      if (entry->kind == AMQP_FIELD_KIND_UTF8
+	  && pool != NULL && (pool->flags & AMQP_POOL_VALIDATE_UTF8)
+	  && !amqp_utf8_valid(entry->value.bytes))
+      {
+	amqp_set_error( ERROR_BAD_AMQP_DATA );
+	check = -ERROR_BAD_AMQP_DATA;
+      }
       break;
     case AMQP_FIELD_KIND_ARRAY:
-      amqp_decode_array(encoded, pool, &(entry->value.array), &offset);
+      check = amqp_decode_array(encoded, pool, &(entry->value.array), &offset);
       break;
     case AMQP_FIELD_KIND_TIMESTAMP:
-      entry->value.u64 = amqp_d64(encoded, offset);
+      DECODE_LIMIT(8);
+      entry->value.u64 = d_64_helper(encoded, offset);
       offset += 8;
       break;
     case AMQP_FIELD_KIND_TABLE:
-      amqp_decode_table(encoded, pool, &(entry->value.table), &offset);
+      if (lazy)
+	check = amqp_decode_table_lazy(encoded, &(entry->value.table), &offset);
+      else
+	check = amqp_decode_table_eager(encoded, pool, &(entry->value.table), &offset);
       break;
     case AMQP_FIELD_KIND_VOID:
       break;
@@ -309,26 +656,95 @@ static int amqp_decode_field_value(amqp_bytes_t encoded,
       break;
   }
 
-  if(( check = (int64_t) amqp_get_error()) != OK )
+  if( check < 0 )
   {
-	amqp_log( __FILE__, __LINE__, LOG_EMERG, "%s !", amqp_error_string( (int) check ));
+	amqp_log( __FILE__, __LINE__, LOG_EMERG, "%s !", amqp_error_string( -check ));
+	return check;
   }
 
   *offsetptr = offset;
-  return (int) check;
+  return OK;
+}
+
+#undef DECODE_LIMIT
+
+/*---------------------------------------------------------------------------*/
+
+static size_t amqp_field_value_encoded_size(amqp_field_value_t const *value); /* forward */
+
+size_t amqp_table_encoded_size(amqp_table_t const *table)
+{
+  size_t size = 4;
+  int    i;
+
+  if (table->num_entries == AMQP_TABLE_LAZY)
+    return amqp_table_raw_bytes(table).len;
+
+  for (i = 0; i < table->num_entries; i++) {
+    size_t value_size = amqp_field_value_encoded_size(&table->entries[i].value);
+    if (value_size == 0)
+      return 0;
+    size += 1 + table->entries[i].key.len + value_size;
+  }
+  return size;
+}
+
+static size_t amqp_field_value_encoded_size(amqp_field_value_t const *value)
+{
+  size_t size = 0;
+  int    i;
+
+  switch (value->kind) {
+    case AMQP_FIELD_KIND_VOID:
+      return 1;
+    case AMQP_FIELD_KIND_BOOLEAN:
+    case AMQP_FIELD_KIND_I8:
+    case AMQP_FIELD_KIND_U8:
+      return 1 + 1;
+    case AMQP_FIELD_KIND_I16:
+    case AMQP_FIELD_KIND_U16:
+      return 1 + 2;
+    case AMQP_FIELD_KIND_I32:
+    case AMQP_FIELD_KIND_U32:
+    case AMQP_FIELD_KIND_F32:
+      return 1 + 4;
+    case AMQP_FIELD_KIND_I64:
+    case AMQP_FIELD_KIND_F64:
+    case AMQP_FIELD_KIND_TIMESTAMP:
+      return 1 + 8;
+    case AMQP_FIELD_KIND_DECIMAL:
+      return 1 + 5;
+    case AMQP_FIELD_KIND_UTF8:
+    case AMQP_FIELD_KIND_BYTES:
+      return 1 + 4 + value->value.bytes.len;
+    case AMQP_FIELD_KIND_ARRAY:
+      for (i = 0; i < value->value.array.num_entries; i++) {
+	size_t entry_size = amqp_field_value_encoded_size(&value->value.array.entries[i]);
+	if (entry_size == 0)
+	  return 0;
+	size += entry_size;
+      }
+      return 1 + 4 + size;
+    case AMQP_FIELD_KIND_TABLE:
+      size = amqp_table_encoded_size(&value->value.table);
+      return size == 0 ? 0 : 1 + size;
+    default:
+      return 0;
+  }
 }
 
 /*---------------------------------------------------------------------------*/
 
 static int amqp_encode_array(amqp_bytes_t encoded,
 			     amqp_array_t *input,
-			     int *offsetptr)
+			     size_t *offsetptr)
 {
-  int     offset           = *offsetptr;
-  int     arraysize_offset = offset;
+  size_t  offset           = *offsetptr;
+  size_t  arraysize_offset = offset;
   int     i;
-  int64_t check            = 0;
+  int     check            = 0;
 
+  CHECK_LIMIT(encoded, offset, 4);
   offset += 4; /* skip space for the size of the array to be filled in later */
 
   for (i = 0; i < input->num_entries; i++)
@@ -338,98 +754,121 @@ static int amqp_encode_array(amqp_bytes_t encoded,
       return check;
   }
 
-  amqp_e32(encoded, arraysize_offset, (offset - *offsetptr - 4));
+  e_32_helper(encoded, arraysize_offset, (uint32_t) (offset - *offsetptr - 4));
   *offsetptr = offset;
   return 0;
 }
 
 int amqp_encode_table(amqp_bytes_t encoded,
 		      amqp_table_t *input,
-		      int *offsetptr)
+		      size_t *offsetptr)
 {
-  int     offset           = *offsetptr;
-  int     tablesize_offset = offset;
+  size_t  offset           = *offsetptr;
+  size_t  tablesize_offset = offset;
   int     i;
-  int64_t check            = 0;
+  int     check            = 0;
+
+  if (input->num_entries == AMQP_TABLE_LAZY) {
+    /* Still encoded: copy it across as it is. */
+    amqp_bytes_t raw = amqp_table_raw_bytes(input);
+    CHECK_LIMIT(encoded, offset, raw.len);
+    memcpy(buf_at(encoded, offset), raw.bytes, raw.len);
+    *offsetptr = offset + raw.len;
+    return 0;
+  }
 
+  CHECK_LIMIT(encoded, offset, 4);
   offset += 4; /* skip space for the size of the table to be filled in later */
 
   for (i = 0; i < input->num_entries; i++) {
     amqp_table_entry_t *entry = &(input->entries[i]);
 
-    amqp_e8(encoded, offset, entry->key.len);
+    CHECK_LIMIT(encoded, offset, 1 + entry->key.len);
+    e_8_helper(encoded, offset, entry->key.len);
     offset++;
 
-    amqp_ebytes(encoded, offset, entry->key.len, entry->key.bytes);
+    memcpy(buf_at(encoded, offset), entry->key.bytes, entry->key.len);
     offset += entry->key.len;
 
     check = amqp_encode_field_value(encoded, &(entry->value), &offset);
     if( check < 0 )
-      return (int) check;
+      return check;
   }
 
-  amqp_e32(encoded, tablesize_offset, (offset - *offsetptr - 4));
+  e_32_helper(encoded, tablesize_offset, (uint32_t) (offset - *offsetptr - 4));
   *offsetptr = offset;
   return 0;
 }
 
 static int amqp_encode_field_value(amqp_bytes_t encoded,
 				   amqp_field_value_t *entry,
-				   int *offsetptr)
+				   size_t *offsetptr)
 {
-  int     offset = *offsetptr;
-  int64_t check  = 0;
+  size_t offset = *offsetptr;
+  int check  = 0;
 
-  amqp_e8(encoded, offset, entry->kind);
+  CHECK_LIMIT(encoded, offset, 1);
+  e_8_helper(encoded, offset, entry->kind);
   offset++;
 
   switch (entry->kind) {
     case AMQP_FIELD_KIND_BOOLEAN:
-      amqp_e8(encoded, offset, entry->value.boolean ? 1 : 0);
+      CHECK_LIMIT(encoded, offset, 1);
+      e_8_helper(encoded, offset, entry->value.boolean ? 1 : 0);
       offset++;
       break;
     case AMQP_FIELD_KIND_I8:
-      amqp_e8(encoded, offset, (uint8_t) entry->value.i8);
+      CHECK_LIMIT(encoded, offset, 1);
+      e_8_helper(encoded, offset, (uint8_t) entry->value.i8);
       offset++;
       break;
     case AMQP_FIELD_KIND_U8:
-      amqp_e8(encoded, offset, entry->value.u8);
+      CHECK_LIMIT(encoded, offset, 1);
+      e_8_helper(encoded, offset, entry->value.u8);
       offset++;
       break;
     case AMQP_FIELD_KIND_I16:
-      amqp_e16(encoded, offset, (uint16_t) entry->value.i16);
+      CHECK_LIMIT(encoded, offset, 2);
+      e_16_helper(encoded, offset, (uint16_t) entry->value.i16);
       offset += 2;
       break;
     case AMQP_FIELD_KIND_U16:
-      amqp_e16(encoded, offset, entry->value.u16);
+      CHECK_LIMIT(encoded, offset, 2);
+      e_16_helper(encoded, offset, entry->value.u16);
       offset += 2;
       break;
     case AMQP_FIELD_KIND_I32:
-      amqp_e32(encoded, offset, (uint32_t) entry->value.i32);
+      CHECK_LIMIT(encoded, offset, 4);
+      e_32_helper(encoded, offset, (uint32_t) entry->value.i32);
       offset += 4;
       break;
     case AMQP_FIELD_KIND_U32:
-      amqp_e32(encoded, offset, entry->value.u32);
+      CHECK_LIMIT(encoded, offset, 4);
+      e_32_helper(encoded, offset, entry->value.u32);
       offset += 4;
       break;
     case AMQP_FIELD_KIND_I64:
-      amqp_e64(encoded, offset, (uint64_t) entry->value.i64);
+      CHECK_LIMIT(encoded, offset, 8);
+      e_64_helper(encoded, offset, (uint64_t) entry->value.i64);
       offset += 8;
       break;
     case AMQP_FIELD_KIND_F32:
       /* by punning, u32 magically gets the right value...! */
-      amqp_e32(encoded, offset, entry->value.u32);
+      CHECK_LIMIT(encoded, offset, 4);
+      e_32_helper(encoded, offset, entry->value.u32);
       offset += 4;
       break;
     case AMQP_FIELD_KIND_F64:
       /* by punning, u64 magically gets the right value...! */
-      amqp_e64(encoded, offset, entry->value.u64);
+      CHECK_LIMIT(encoded, offset, 8);
+      e_64_helper(encoded, offset, entry->value.u64);
       offset += 8;
       break;
     case AMQP_FIELD_KIND_DECIMAL:
-      amqp_e8(encoded, offset, entry->value.decimal.decimals);
+      CHECK_LIMIT(encoded, offset, 5);
+      e_8_helper(encoded, offset, entry->value.decimal.decimals);
       offset++;
-      amqp_e32(encoded, offset, entry->value.decimal.value);
+      e_32_helper(encoded, offset, entry->value.decimal.value);
       offset += 4;
       break;
     case AMQP_FIELD_KIND_UTF8:
@@ -437,16 +876,18 @@ static int amqp_encode_field_value(amqp_bytes_t encoded,
 	 same implementation, but different interpretations. */
       /* fall through */
     case AMQP_FIELD_KIND_BYTES:
-      amqp_e32(encoded, offset, entry->value.bytes.len);
+      CHECK_LIMIT(encoded, offset, 4 + entry->value.bytes.len);
+      e_32_helper(encoded, offset, entry->value.bytes.len);
       offset += 4;
-      amqp_ebytes(encoded, offset, entry->value.bytes.len, entry->value.bytes.bytes);
+      memcpy(buf_at(encoded, offset), entry->value.bytes.bytes, entry->value.bytes.len);
       offset += entry->value.bytes.len;
       break;
     case AMQP_FIELD_KIND_ARRAY:
       check = amqp_encode_array(encoded, &(entry->value.array), &offset);
       break;
     case AMQP_FIELD_KIND_TIMESTAMP:
-      amqp_e64(encoded, offset, entry->value.u64);
+      CHECK_LIMIT(encoded, offset, 8);
+      e_64_helper(encoded, offset, entry->value.u64);
       offset += 8;
       break;
     case AMQP_FIELD_KIND_TABLE:
@@ -455,19 +896,80 @@ static int amqp_encode_field_value(amqp_bytes_t encoded,
     case AMQP_FIELD_KIND_VOID:
       break;
     default:
-      check = ERROR_BAD_AMQP_DATA;
+      check = -ERROR_BAD_AMQP_DATA;
   }
 
   if( check < 0 )
   {
-	amqp_log( __FILE__, __LINE__, LOG_EMERG, "%s !", amqp_error_string( (int) check ));
+	amqp_log( __FILE__, __LINE__, LOG_EMERG, "%s !", amqp_error_string( -check ));
+	return check;
   }
   *offsetptr = offset;
-  return (int) check;
+  return 0;
 }
 
 /*---------------------------------------------------------------------------*/
 
+amqp_boolean_t amqp_table_is_lazy(amqp_table_t const *table)
+{
+  return table->num_entries == AMQP_TABLE_LAZY;
+}
+
+int amqp_table_find(amqp_table_t const *table,
+		    amqp_bytes_t key,
+		    amqp_pool_t *pool,
+		    amqp_field_value_t *value)
+{
+  amqp_bytes_t encoded;
+  size_t       offset;
+  int          i;
+
+  if (table->num_entries != AMQP_TABLE_LAZY) {
+    for (i = 0; i < table->num_entries; i++) {
+      amqp_table_entry_t const *entry = &table->entries[i];
+      if (entry->key.len == key.len && amqp_keys_equal(entry->key.bytes, key.bytes, key.len)) {
+	*value = entry->value;
+	return 1;
+      }
+    }
+    return 0;
+  }
+
+  /* Walk the encoded entries, decoding only the value asked for. */
+  encoded = amqp_table_raw_bytes(table);
+  offset = 4;
+  while (offset < encoded.len) {
+    size_t keylen = d_8_helper(encoded, offset);
+    size_t value_offset;
+    int    check;
+
+    offset++;
+    CHECK_LIMIT(encoded, offset, keylen);
+    value_offset = offset + keylen;
+
+    check = amqp_skip_field_value(encoded, &value_offset);
+    if (check < 0)
+      return check;
+
+    if (keylen == key.len && amqp_keys_equal(buf_at(encoded, offset), key.bytes, keylen)) {
+      offset += keylen;
+      check = amqp_decode_field_value(encoded, pool, value, &offset, 1);
+      return check < 0 ? check : 1;
+    }
+    offset = value_offset;
+  }
+  return 0;
+}
+
+int amqp_table_materialize(amqp_table_t *table, amqp_pool_t *pool)
+{
+  size_t offset = 0;
+
+  if (table->num_entries != AMQP_TABLE_LAZY)
+    return 0;
+  return amqp_decode_table_eager(amqp_table_raw_bytes(table), pool, table, &offset);
+}
+
 int amqp_table_entry_cmp(void const *entry1, void const *entry2) {
   amqp_table_entry_t const *p1 = (amqp_table_entry_t const *) entry1;
   amqp_table_entry_t const *p2 = (amqp_table_entry_t const *) entry2;
@@ -485,3 +987,236 @@ int amqp_table_entry_cmp(void const *entry1, void const *entry2) {
 
   return p1->key.len - p2->key.len;
 }
+
+void amqp_table_sort(amqp_table_t *table)
+{
+  if (table->num_entries > 1) {
+    amqp_sort_table_entries(table->entries, table->num_entries);
+  }
+}
+
+amqp_field_value_t *amqp_table_get(amqp_table_t const *table, amqp_bytes_t key)
+{
+  amqp_table_entry_t probe;
+  amqp_table_entry_t *entry;
+
+  if (table->num_entries <= 0) {
+    return NULL; /* empty, or lazy: see amqp_table_find */
+  }
+
+  probe.key = key;
+  entry = bsearch(&probe, table->entries, table->num_entries, sizeof(amqp_table_entry_t), amqp_table_entry_cmp);
+  return entry == NULL ? NULL : &entry->value;
+}
+
+amqp_field_value_t *amqp_table_get_path(amqp_table_t const *table,
+					amqp_bytes_t const *keys,
+					int num_keys)
+{
+  amqp_field_value_t *value = NULL;
+  int i;
+
+  for (i = 0; i < num_keys; i++) {
+    if (i > 0) {
+      if (value->kind != AMQP_FIELD_KIND_TABLE) {
+	return NULL;
+      }
+      table = &value->value.table;
+    }
+    value = amqp_table_get(table, keys[i]);
+    if (value == NULL) {
+      return NULL;
+    }
+  }
+  return value;
+}
+
+/*
+ * The encoding is kept in memory from the library-wide allocator,
+ * sized exactly, and handed out as a lazy table over it.
+ */
+int amqp_encoded_table_init(amqp_encoded_table_t *encoded,
+			    amqp_table_t const *table)
+{
+  size_t size   = amqp_table_encoded_size(table);
+  size_t offset = 0;
+  int    check;
+
+  encoded->bytes.len = 0;
+  encoded->bytes.bytes = NULL;
+
+  if (size == 0)
+    return -ERROR_BAD_AMQP_DATA;
+
+  encoded->bytes = amqp_bytes_malloc(size);
+  if (encoded->bytes.bytes == NULL)
+    return -ERROR_NO_MEMORY;
+
+  check = amqp_encode_table(encoded->bytes, (amqp_table_t *) table, &offset);
+  if (check < 0) {
+    amqp_encoded_table_destroy(encoded);
+    return check;
+  }
+  return 0;
+}
+
+void amqp_encoded_table_destroy(amqp_encoded_table_t *encoded)
+{
+  amqp_bytes_free(encoded->bytes);
+  encoded->bytes.len = 0;
+  encoded->bytes.bytes = NULL;
+}
+
+amqp_table_t amqp_encoded_table_get(amqp_encoded_table_t const *encoded)
+{
+  amqp_table_t table;
+  table.num_entries = AMQP_TABLE_LAZY;
+  table.entries = encoded->bytes.bytes;
+  return table;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/* Carves the arrays of a compact table out of one pool block. */
+static int amqp_compact_table_alloc(amqp_compact_table_t *compact,
+				    int num_entries,
+				    size_t key_bytes,
+				    amqp_pool_t *pool)
+{
+  size_t values_size  = num_entries * sizeof(amqp_field_value_union_t);
+  size_t offsets_size = (num_entries + 1) * sizeof(uint32_t);
+  char  *block;
+
+  block = amqp_pool_alloc(pool, values_size + offsets_size + num_entries + key_bytes);
+  if (block == NULL)
+    return -ERROR_NO_MEMORY;
+
+  compact->num_entries = num_entries;
+  compact->values = (amqp_field_value_union_t *) block;
+  compact->key_offsets = (uint32_t *) (block + values_size);
+  compact->kinds = block + values_size + offsets_size;
+  compact->keys = compact->kinds + num_entries;
+  compact->key_offsets[0] = 0;
+  return 0;
+}
+
+int amqp_compact_table_init(amqp_compact_table_t *compact,
+			    amqp_table_t const *table,
+			    amqp_pool_t *pool)
+{
+  size_t key_bytes = 0;
+  int    check;
+  int    i;
+
+  if (table->num_entries == AMQP_TABLE_LAZY) {
+    /* Decode straight from the wire form. */
+    amqp_bytes_t encoded = amqp_table_raw_bytes(table);
+    size_t       offset  = 4;
+    int          num_entries;
+
+    check = amqp_count_table_entries(encoded, offset, &num_entries, &key_bytes);
+    if (check < 0)
+      return check;
+    check = amqp_compact_table_alloc(compact, num_entries, key_bytes, pool);
+    if (check < 0)
+      return check;
+
+    for (i = 0; i < num_entries; i++) {
+      size_t             keylen = d_8_helper(encoded, offset);
+      amqp_field_value_t value;
+
+      offset++;
+      memcpy(compact->keys + compact->key_offsets[i], buf_at(encoded, offset), keylen);
+      compact->key_offsets[i + 1] = compact->key_offsets[i] + keylen;
+      offset += keylen;
+
+      check = amqp_decode_field_value(encoded, pool, &value, &offset, 0);
+      if (check < 0)
+	return check;
+      compact->kinds[i] = value.kind;
+      compact->values[i] = value.value;
+    }
+    return 0;
+  }
+
+  for (i = 0; i < table->num_entries; i++) {
+    key_bytes += table->entries[i].key.len;
+  }
+  check = amqp_compact_table_alloc(compact, table->num_entries, key_bytes, pool);
+  if (check < 0)
+    return check;
+
+  for (i = 0; i < table->num_entries; i++) {
+    amqp_table_entry_t const *entry = &table->entries[i];
+
+    memcpy(compact->keys + compact->key_offsets[i], entry->key.bytes, entry->key.len);
+    compact->key_offsets[i + 1] = compact->key_offsets[i] + entry->key.len;
+    compact->kinds[i] = entry->value.kind;
+    compact->values[i] = entry->value.value;
+  }
+  return 0;
+}
+
+int amqp_compact_table_find(amqp_compact_table_t const *compact,
+			    amqp_bytes_t key)
+{
+  int i = 0;
+
+  if (key.len > 255)
+    return -1;
+
+  /* Compare key lengths four entries at a time, then check the bytes
+     of those that match. This pays off once tables hold a few dozen
+     keys of differing lengths; the AVX2 form, eight at a time, did
+     not (see bench/simd_bench.c). */
+#if defined(AMQP_TABLE_SSE2)
+  {
+    __m128i len = _mm_set1_epi32((int) key.len);
+    int j;
+
+    for (; i + 4 <= compact->num_entries; i += 4) {
+      __m128i start = _mm_loadu_si128((__m128i const *) (compact->key_offsets + i));
+      __m128i end = _mm_loadu_si128((__m128i const *) (compact->key_offsets + i + 1));
+      int mask = _mm_movemask_ps(_mm_castsi128_ps(
+		   _mm_cmpeq_epi32(_mm_sub_epi32(end, start), len)));
+      for (j = 0; mask != 0; j++, mask >>= 1) {
+	if ((mask & 1)
+	    && amqp_keys_equal(compact->keys + compact->key_offsets[i + j], key.bytes, key.len))
+	  return i + j;
+      }
+    }
+  }
+#endif
+
+  for (; i < compact->num_entries; i++) {
+    if (compact->key_offsets[i + 1] - compact->key_offsets[i] == key.len
+	&& amqp_keys_equal(compact->keys + compact->key_offsets[i], key.bytes, key.len))
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int amqp_compact_table_to_table(amqp_table_t *table,
+				amqp_compact_table_t const *compact,
+				amqp_pool_t *pool)
+{
+  amqp_table_entry_t *entries;
+  int i;
+
+  entries = amqp_pool_alloc(pool, compact->num_entries * sizeof(amqp_table_entry_t));
+  if (entries == NULL && compact->num_entries > 0)
+    return -ERROR_NO_MEMORY;
+
+  for (i = 0; i < compact->num_entries; i++) {
+    entries[i].key.len = compact->key_offsets[i + 1] - compact->key_offsets[i];
+    entries[i].key.bytes = compact->keys + compact->key_offsets[i];
+    entries[i].value.kind = compact->kinds[i];
+    entries[i].value.value = compact->values[i];
+  }
+
+  table->num_entries = compact->num_entries;
+  table->entries = entries;
+  return 0;
+}
@@ -65,7 +65,7 @@
  * ========================================================================
  */
 
-int g_errno = OK;
+AMQP_THREAD_LOCAL int g_errno = OK; /* per thread; see also amqp_get_connection_error() */
 
 /* ========================================================================
  * FUNCTIONS
@@ -80,7 +80,7 @@ void amqp_set_error( int error )
 #if !defined( NDEBUG )
 void amqp_assert( int nCondition, char *pcFormat, ...)
 {
-  static char acBuffer[ MAX_BUFFER_SIZE ];
+  static AMQP_THREAD_LOCAL char acBuffer[ MAX_BUFFER_SIZE ];
 
   va_list vArgs;
 
@@ -107,302 +107,6 @@ void amqp_assert( int condition, char *pcFormat, ...)
 }
 #endif
 
-#if !defined( NDEBUG )
-inline
-#endif
-void * buf_at(amqp_bytes_t bytes, int offset)
-{
-  /* (&(((uint8_t *) (b).bytes)[o])); */
-  uint8_t *pBuf = bytes.bytes;
-
-#ifdef NDEBUG
-  fprintf(stderr, "buf_at: At entry: Address = 0x%x.\n", pBuf);
-#endif
-
-  /* pBuf += o; */
-
-  pBuf = &((uint8_t*)bytes.bytes)[offset];
-
-#ifdef NDEBUG
-  fprintf(stderr, "buf_at: At exit:  Address = 0x%x.\n", pBuf);
-#endif
-
-  return pBuf;
-}
-
-#if !defined( NDEBUG )
-inline
-#endif
-int check_limit( amqp_bytes_t bytes, int offset, int length)
-{
-  if ((offset + length) > bytes.len)
-  {
-	amqp_set_error(ERROR_BAD_AMQP_DATA);
-	return -ERROR_BAD_AMQP_DATA;
-  }
-  else
-	return 0;
-}
-
-#if !defined( NDEBUG )
-inline
-#endif
-uint8_t d_8_helper(amqp_bytes_t bytes, uint16_t offset)
-{
-  return * (uint8_t *) buf_at(bytes, offset);
-}
-
-#if !defined( NDEBUG )
-inline
-#endif
-uint8_t amqp_d8(amqp_bytes_t bytes, uint16_t offset)
-{
-  return d_8_helper(bytes, offset);
-}
-
-#if !defined( NDEBUG )
-inline
-#endif
-uint16_t d_16_helper(amqp_bytes_t bytes, uint16_t offset)
-{
-  uint16_t value;
-  memcpy(&value, buf_at(bytes, offset), 2);
-  return ntohl(value);
-}
-
-#if !defined( NDEBUG )
-inline
-#endif
-uint16_t amqp_d16(amqp_bytes_t bytes, uint16_t offset)
-{
-  int check_result = check_limit(bytes, offset, 2);
-
-  if( check_result < 0)
-  {
-	amqp_log_error( __FILE__, __LINE__, LOG_CRIT,
-			        ERROR_LIMIT_OUT_OF_BOUNDS,
-			        "Offset = %d.", offset );
-	return 0;
-  }
-
-  return d_16_helper(bytes, offset);
-}
-
-#if !defined( NDEBUG )
-inline
-#endif
-uint32_t d_32_helper(amqp_bytes_t bytes, uint16_t offset)
-{
-  uint32_t value  = 0;
-  uint32_t result = 0;
-  
-  memcpy(&value, buf_at(bytes, offset), 4);
-  
-  result = ntohl(value);
-  
-#if defined( NDEBUG )
-  fprintf(stderr, "d_32_helper: Result = %d.\n", result );
-#endif
-  
-  return result;
-}
-
-#if !defined( NDEBUG )
-inline
-#endif
-uint32_t amqp_d32(amqp_bytes_t bytes, uint16_t offset)
-{
-  int check_result = check_limit(bytes, offset, 4);
-
-  if( check_result < 0)
-  {
-	amqp_log_error( __FILE__, __LINE__, LOG_CRIT,
-				    ERROR_LIMIT_OUT_OF_BOUNDS,
-				    "Offset = %d.", offset );
-	return 0;
-  }
-
-  return d_32_helper(bytes, offset);
-}
-
-#if !defined( NDEBUG )
-inline
-#endif
-uint64_t d_64_helper(amqp_bytes_t bytes, uint16_t offset)
-{
-  uint64_t hi = d_32_helper(bytes, offset);
-  uint64_t lo = d_32_helper(bytes, offset + 4);
-
-  if( amqp_get_error() != 0 )
-  {
-	amqp_log_error( __FILE__, __LINE__, LOG_CRIT,
-				    ERROR_LIMIT_OUT_OF_BOUNDS,
-				    "Offset = %d.", offset );
-	return 0;
-  }
-
-  if( amqp_get_error() != 0 )
-  {
-	amqp_log_error( __FILE__, __LINE__, LOG_CRIT,
-				    ERROR_LIMIT_OUT_OF_BOUNDS,
-				    "Offset = %d.", offset );
-	return 0;
-  }
-
-  return hi << 32 | lo;
-}
-
-#if !defined( NDEBUG )
-inline
-#endif
-uint64_t amqp_d64(amqp_bytes_t bytes, uint16_t offset)
-{
-  int check_result = check_limit(bytes, offset, 8);
-
-  if( check_result < 0)
-  {
-	amqp_log_error( __FILE__, __LINE__, LOG_CRIT,
-				    ERROR_LIMIT_OUT_OF_BOUNDS,
-				    "Offset = %d.", offset );
-	return 0;
-  }
-
-  return d_64_helper(bytes, offset);
-}
-
-#if !defined( NDEBUG )
-inline
-#endif
-uint8_t *amqp_dbytes(amqp_bytes_t bytes, uint16_t offset, uint16_t len)
-{
-  if(( offset + len ) > bytes.len )
-  {
-	amqp_log_error( __FILE__, __LINE__, LOG_CRIT,
-					ERROR_LIMIT_OUT_OF_BOUNDS,
-					"Offset = %d.", offset );
-    return NULL;
-  }
-  else
-  {
-    return buf_at( bytes, offset );
-  }
-}
-
-#if !defined( NDEBUG )
-inline
-#endif
-void e_8_helper(amqp_bytes_t bytes, uint16_t offset, uint8_t value)
-{
-  * (uint8_t *) buf_at(bytes, offset) = value;
-}
-
-#if !defined( NDEBUG )
-inline
-#endif
-int64_t amqp_e8(amqp_bytes_t bytes, uint16_t offset, uint8_t value)
-{
-  int64_t check = check_limit(bytes, offset, 1);
-  if( check < 0 )
-  {
-	amqp_log_error( __FILE__, __LINE__, LOG_CRIT,
-				    ERROR_LIMIT_OUT_OF_BOUNDS,
-				    "Offset = %d.", offset );
-	return check;
-  }
-
-  e_8_helper(bytes, offset, value);
-
-  return 0;
-}
-
-#if !defined( NDEBUG )
-inline
-#endif
-void e_16_helper(amqp_bytes_t bytes, uint16_t offset, uint16_t value)
-{
-  uint16_t vv = htons(value);
-  memcpy(buf_at(bytes, offset), &vv, 2);
-}
-
-#if !defined( NDEBUG )
-inline
-#endif
-int64_t amqp_e16(amqp_bytes_t bytes, uint16_t offset, uint16_t value)
-{
-  int check_result = check_limit(bytes, offset, 2);
-
-  if( check_result < 0)
-  {
-	amqp_log_error( __FILE__, __LINE__, LOG_CRIT,
-				    ERROR_LIMIT_OUT_OF_BOUNDS,
-				    "Offset = %d.", offset );
-	return check_result;
-  }
-
-  e_16_helper(bytes, offset, value);
-
-  return 0;
-}
-
-#if !defined( NDEBUG )
-inline
-#endif
-void e_32_helper(amqp_bytes_t bytes, uint16_t offset, uint32_t value)
-{
-  uint32_t vv = htonl(value);
-  memcpy(buf_at(bytes, offset), &vv, 4);
-}
-
-#if !defined( NDEBUG )
-inline
-#endif
-int64_t amqp_e32(amqp_bytes_t bytes, uint16_t offset, uint32_t value)
-{
-  int check_result = check_limit(bytes, offset, 2);
-
-  if( check_result < 0)
-  {
-	amqp_log_error( __FILE__, __LINE__, LOG_CRIT,
-				    ERROR_LIMIT_OUT_OF_BOUNDS,
-				    "Offset = %d.", offset );
-	return check_result;
-  }
-
-  e_32_helper(bytes, offset, value);
-
-  return 0;
-}
-
-#if !defined( NDEBUG )
-inline
-#endif
-int64_t amqp_e64(amqp_bytes_t bytes, uint16_t offset, uint64_t value)
-{
-  e_32_helper(bytes, offset, (uint32_t) (((uint64_t) value) >> 32));
-  e_32_helper(bytes, offset + 4, (uint32_t) (((uint64_t) value) & 0xFFFFFFFF));
-
-  return 0;
-}
-
-#if !defined( NDEBUG )
-inline
-#endif
-int64_t amqp_ebytes(amqp_bytes_t bytes, uint16_t offset, uint16_t len, uint64_t *pvalue)
-{
-  int64_t check = check_limit( bytes, offset, len);
-  if( check < 0 )
-  {
-	amqp_log_error( __FILE__, __LINE__, LOG_CRIT,
-				    ERROR_LIMIT_OUT_OF_BOUNDS,
-				    "Offset = %d.", offset );
-	return check;
-  }
-
-  memcpy(buf_at(bytes, offset), pvalue, len);
-
-  return 0;
-}
-
 /* ========================================================================
  * *** END OF FILE ***
  * ========================================================================
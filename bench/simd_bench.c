@@ -0,0 +1,322 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0
+ *
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See
+ * the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * The Original Code is librabbitmq.
+ *
+ * The Initial Developers of the Original Code are LShift Ltd, Cohesive
+ * Financial Technologies LLC, and Rabbit Technologies Ltd.  Portions
+ * created before 22-Nov-2008 00:00:00 GMT by LShift Ltd, Cohesive
+ * Financial Technologies LLC, or Rabbit Technologies Ltd are Copyright
+ * (C) 2007-2008 LShift Ltd, Cohesive Financial Technologies LLC, and
+ * Rabbit Technologies Ltd.
+ *
+ * Portions created by LShift Ltd are Copyright (C) 2007-2009 LShift
+ * Ltd. Portions created by Cohesive Financial Technologies LLC are
+ * Copyright (C) 2007-2009 Cohesive Financial Technologies
+ * LLC. Portions created by Rabbit Technologies Ltd are Copyright (C)
+ * 2007-2009 Rabbit Technologies Ltd.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (C) 2009-2010
+ * LShift Ltd and Tony Garnock-Jones.
+ *
+ * All Rights Reserved.
+ *
+ * Contributor(s): ______________________________________.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License Version 2 or later (the "GPL"), in
+ * which case the provisions of the GPL are applicable instead of those
+ * above. If you wish to allow use of your version of this file only
+ * under the terms of the GPL, and not to allow others to use your
+ * version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the
+ * notice and other provisions required by the GPL. If you do not
+ * delete the provisions above, a recipient may use your version of
+ * this file under the terms of any one of the MPL or the GPL.
+ *
+ * ***** END LICENSE BLOCK *****
+ */
+/*
+ * Times amqp_utf8_valid and amqp_compact_table_find against plain
+ * scalar versions, and the SSE2 key comparison amqp_keys_equal used
+ * to have against memcmp (all copied below), to check that the vector
+ * paths in amqp_table.c pay for themselves. Built and run by "make
+ * bench"; build with -mavx2 to time the AVX2 path of amqp_utf8_valid.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "amqp.h"
+#include "amqp_private.h"
+#include "socket.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BENCH_SSE2 1
+#endif
+
+#define TOTAL_BYTES 100000000 /* validated per input and version */
+#define TOTAL_LOOKUPS 5000000 /* per table size and version */
+#define TOTAL_COMPARES 50000000 /* per key length and version */
+
+/* Keeps results live, so the timed calls are not optimised away. */
+static volatile int sink;
+
+static size_t scalar_utf8_sequence_length(unsigned char const *p, size_t avail)
+{
+  unsigned char c = p[0];
+  unsigned char lo = 0x80, hi = 0xBF;
+  size_t n, i;
+
+  if (c < 0x80)
+    return 1;
+  else if (c >= 0xC2 && c <= 0xDF)
+    n = 2;
+  else if (c >= 0xE0 && c <= 0xEF) {
+    n = 3;
+    if (c == 0xE0) lo = 0xA0;
+    if (c == 0xED) hi = 0x9F;
+  } else if (c >= 0xF0 && c <= 0xF4) {
+    n = 4;
+    if (c == 0xF0) lo = 0x90;
+    if (c == 0xF4) hi = 0x8F;
+  } else
+    return 0;
+
+  if (avail < n || p[1] < lo || p[1] > hi)
+    return 0;
+  for (i = 2; i < n; i++) {
+    if ((p[i] & 0xC0) != 0x80)
+      return 0;
+  }
+  return n;
+}
+
+static amqp_boolean_t scalar_utf8_valid(amqp_bytes_t bytes)
+{
+  unsigned char const *p = bytes.bytes;
+  size_t i = 0;
+
+  while (i < bytes.len) {
+    size_t n = scalar_utf8_sequence_length(p + i, bytes.len - i);
+    if (n == 0)
+      return 0;
+    i += n;
+  }
+  return 1;
+}
+
+static int scalar_compact_table_find(amqp_compact_table_t const *compact,
+				     amqp_bytes_t key)
+{
+  int i;
+
+  for (i = 0; i < compact->num_entries; i++) {
+    if (compact->key_offsets[i + 1] - compact->key_offsets[i] == key.len
+	&& memcmp(compact->keys + compact->key_offsets[i], key.bytes, key.len) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/* The SSE2 loop amqp_keys_equal used ahead of memcmp. */
+static int sse2_keys_equal(char const *a, char const *b, size_t len)
+{
+#ifdef BENCH_SSE2
+  while (len >= 16) {
+    __m128i x = _mm_loadu_si128((__m128i const *) a);
+    __m128i y = _mm_loadu_si128((__m128i const *) b);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF)
+      return 0;
+    a += 16;
+    b += 16;
+    len -= 16;
+  }
+#endif
+  return memcmp(a, b, len) == 0;
+}
+
+static int memcmp_keys_equal(char const *a, char const *b, size_t len)
+{
+  return memcmp(a, b, len) == 0;
+}
+
+static void report(char const *what, double base_ns, double new_ns)
+{
+  printf("  %-28s %12.1f %12.1f %8.2fx\n", what, base_ns, new_ns, base_ns / new_ns);
+}
+
+typedef amqp_boolean_t (*utf8_fn_t)(amqp_bytes_t bytes);
+
+/* Nanoseconds per call. */
+static double time_utf8(utf8_fn_t valid, amqp_bytes_t text)
+{
+  int iterations = (int) (TOTAL_BYTES / text.len);
+  uint64_t start = amqp_monotonic_usec();
+  int i;
+
+  for (i = 0; i < iterations; i++) {
+    if (!valid(text)) {
+      fprintf(stderr, "valid UTF-8 rejected\n");
+      exit(1);
+    }
+  }
+  return (amqp_monotonic_usec() - start) * 1000.0 / iterations;
+}
+
+/* Text of len bytes, with a two-byte sequence every `every` bytes (0 for none). */
+static amqp_bytes_t build_text(size_t len, size_t every)
+{
+  amqp_bytes_t text;
+  char *p = malloc(len);
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    if (every != 0 && i % every == every - 2 && i + 1 < len) {
+      p[i++] = (char) 0xC3; /* U+00E9 */
+      p[i] = (char) 0xA9;
+    } else {
+      p[i] = 'a' + i % 26;
+    }
+  }
+  text.len = len;
+  text.bytes = p;
+  return text;
+}
+
+static void bench_utf8(void)
+{
+  static struct { size_t len, every; char const *name; } const inputs[] = {
+    { 16, 0, "ascii, 16 bytes" },
+    { 256, 0, "ascii, 256 bytes" },
+    { 4096, 0, "ascii, 4096 bytes" },
+    { 256, 64, "1 in 64 non-ascii, 256 B" },
+    { 4096, 8, "1 in 8 non-ascii, 4096 B" },
+  };
+  size_t i;
+
+  printf("amqp_utf8_valid %19s %12s %12s %9s\n", "", "scalar ns", "library ns", "speedup");
+  for (i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+    amqp_bytes_t text = build_text(inputs[i].len, inputs[i].every);
+    report(inputs[i].name, time_utf8(scalar_utf8_valid, text), time_utf8(amqp_utf8_valid, text));
+    free(text.bytes);
+  }
+}
+
+typedef int (*find_fn_t)(amqp_compact_table_t const *compact, amqp_bytes_t key);
+
+/* Nanoseconds per lookup, looking up every key in turn. */
+static double time_find(find_fn_t find, amqp_compact_table_t const *compact, amqp_bytes_t const *keys)
+{
+  int iterations = TOTAL_LOOKUPS / compact->num_entries;
+  uint64_t start = amqp_monotonic_usec();
+  int i, k;
+
+  for (i = 0; i < iterations; i++) {
+    for (k = 0; k < compact->num_entries; k++) {
+      if (find(compact, keys[k]) != k) {
+	fprintf(stderr, "lookup failed\n");
+	exit(1);
+      }
+    }
+  }
+  return (amqp_monotonic_usec() - start) * 1000.0 / ((double) iterations * compact->num_entries);
+}
+
+static void bench_compact_find(void)
+{
+  static int const sizes[] = { 5, 50, 500 };
+  amqp_pool_t pool;
+  size_t s;
+
+  init_amqp_pool(&pool, 65536);
+  printf("amqp_compact_table_find %11s %12s %12s %9s\n", "", "scalar ns", "library ns", "speedup");
+  for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    int n = sizes[s];
+    amqp_table_entry_t *entries = amqp_pool_alloc(&pool, n * sizeof(amqp_table_entry_t));
+    amqp_bytes_t *keys = amqp_pool_alloc(&pool, n * sizeof(amqp_bytes_t));
+    amqp_compact_table_t compact;
+    amqp_table_t table;
+    char name[40];
+    int i;
+
+    for (i = 0; i < n; i++) {
+      char *key = amqp_pool_alloc(&pool, 24);
+      /* header names of 4 to 18 bytes */
+      sprintf(key, "x-%.*s-%d", i % 13, "header-xxxxxx", i);
+      entries[i].key = keys[i] = amqp_cstring_bytes(key);
+      entries[i].value.kind = AMQP_FIELD_KIND_I32;
+      entries[i].value.value.i32 = i;
+    }
+    table.num_entries = n;
+    table.entries = entries;
+    if (amqp_compact_table_init(&compact, &table, &pool) < 0) {
+      fprintf(stderr, "cannot build a compact table of %d entries\n", n);
+      exit(1);
+    }
+
+    sprintf(name, "%d entries", n);
+    report(name, time_find(scalar_compact_table_find, &compact, keys),
+	   time_find(amqp_compact_table_find, &compact, keys));
+  }
+  empty_amqp_pool(&pool);
+}
+
+typedef int (*equal_fn_t)(char const *a, char const *b, size_t len);
+
+/* Nanoseconds per comparison of two equal keys of len bytes. */
+static double time_equal(equal_fn_t equal, char const *a, char const *b, size_t len)
+{
+  int iterations = TOTAL_COMPARES;
+  uint64_t start = amqp_monotonic_usec();
+  int i, hits = 0;
+
+  for (i = 0; i < iterations; i++) {
+    /* through a volatile function pointer, as in a real lookup loop
+       the call is not hoisted */
+    equal_fn_t volatile fn = equal;
+    hits += fn(a, b, len);
+  }
+  sink = hits;
+  return (amqp_monotonic_usec() - start) * 1000.0 / iterations;
+}
+
+static void bench_keys_equal(void)
+{
+  static size_t const lengths[] = { 8, 16, 32, 64, 255 };
+  char a[256], b[256];
+  size_t i;
+
+  for (i = 0; i < sizeof(a); i++)
+    a[i] = b[i] = 'a' + i % 26;
+
+  printf("amqp_keys_equal %19s %12s %12s %9s\n", "", "SSE2 ns", "memcmp ns", "speedup");
+  for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+    char name[40];
+    sprintf(name, "%u byte keys", (unsigned) lengths[i]);
+    report(name, time_equal(sse2_keys_equal, a, b, lengths[i]),
+	   time_equal(memcmp_keys_equal, a, b, lengths[i]));
+  }
+}
+
+int main(void)
+{
+  bench_utf8();
+  bench_compact_find();
+  bench_keys_equal();
+  return 0;
+}
@@ -0,0 +1,443 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0
+ *
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See
+ * the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * The Original Code is librabbitmq.
+ *
+ * The Initial Developers of the Original Code are LShift Ltd, Cohesive
+ * Financial Technologies LLC, and Rabbit Technologies Ltd.  Portions
+ * created before 22-Nov-2008 00:00:00 GMT by LShift Ltd, Cohesive
+ * Financial Technologies LLC, or Rabbit Technologies Ltd are Copyright
+ * (C) 2007-2008 LShift Ltd, Cohesive Financial Technologies LLC, and
+ * Rabbit Technologies Ltd.
+ *
+ * Portions created by LShift Ltd are Copyright (C) 2007-2009 LShift
+ * Ltd. Portions created by Cohesive Financial Technologies LLC are
+ * Copyright (C) 2007-2009 Cohesive Financial Technologies
+ * LLC. Portions created by Rabbit Technologies Ltd are Copyright (C)
+ * 2007-2009 Rabbit Technologies Ltd.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (C) 2009-2010
+ * LShift Ltd and Tony Garnock-Jones.
+ *
+ * All Rights Reserved.
+ *
+ * Contributor(s): ______________________________________.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License Version 2 or later (the "GPL"), in
+ * which case the provisions of the GPL are applicable instead of those
+ * above. If you wish to allow use of your version of this file only
+ * under the terms of the GPL, and not to allow others to use your
+ * version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the
+ * notice and other provisions required by the GPL. If you do not
+ * delete the provisions above, a recipient may use your version of
+ * this file under the terms of any one of the MPL or the GPL.
+ *
+ * ***** END LICENSE BLOCK *****
+ */
+
+/*
+ * Times amqp_decode_table on header tables of 5, 50 and 500 entries
+ * against the decoder it replaced, which grew a malloc'd entry array
+ * and copied it into the pool (kept below as old_decode_table). Then
+ * the same for sorted tables: the old decoder followed by
+ * amqp_table_sort(), against decoding with AMQP_POOL_SORTED_TABLES.
+ * Built and run by "make bench".
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "amqp.h"
+#include "amqp_private.h"
+#include "socket.h"
+
+#define TOTAL_ENTRIES 4000000 /* decoded per size and decoder */
+
+static int old_decode_field_value(amqp_bytes_t encoded,
+				  amqp_pool_t *pool,
+				  amqp_field_value_t *entry,
+				  size_t *offsetptr); /* forward */
+
+#define CHECK_LIMIT(encoded, offset, length)				\
+  if (check_limit((encoded), (offset), (length)) < 0) {		\
+    return -ERROR_BAD_AMQP_DATA;					\
+  }
+
+static int old_decode_array(amqp_bytes_t encoded,
+			    amqp_pool_t *pool,
+			    amqp_array_t *output,
+			    size_t *offsetptr)
+{
+  size_t              offset            = *offsetptr;
+  int                 check             = OK;
+  uint32_t            arraysize         = 0;
+  int                 num_entries       = 0;
+  int                 allocated_entries = 16;
+  amqp_field_value_t *entries           = NULL;
+
+  CHECK_LIMIT(encoded, offset, 4);
+  arraysize = d_32_helper(encoded, offset);
+  offset += 4;
+  CHECK_LIMIT(encoded, offset, arraysize);
+  encoded.len = offset + arraysize;
+
+  entries = amqp_malloc(pool->allocator, allocated_entries * sizeof(amqp_field_value_t));
+  if (entries == NULL) {
+    return -ERROR_NO_MEMORY;
+  }
+
+  while (offset < encoded.len) {
+    if (num_entries >= allocated_entries) {
+      void *newentries;
+      allocated_entries = allocated_entries * 2;
+      newentries = amqp_realloc(pool->allocator, entries, allocated_entries * sizeof(amqp_field_value_t));
+      if (newentries == NULL) {
+	amqp_free(pool->allocator, entries);
+	return -ERROR_NO_MEMORY;
+      }
+      entries = newentries;
+    }
+
+    check = old_decode_field_value(encoded, pool, &entries[num_entries], &offset);
+    if (check < 0) {
+      amqp_free(pool->allocator, entries);
+      return check;
+    }
+    num_entries++;
+  }
+
+  output->num_entries = num_entries;
+  output->entries = amqp_pool_alloc(pool, num_entries * sizeof(amqp_field_value_t));
+  if (output->entries == NULL && num_entries > 0) {
+    amqp_free(pool->allocator, entries);
+    return -ERROR_NO_MEMORY;
+  }
+
+  memcpy(output->entries, entries, num_entries * sizeof(amqp_field_value_t));
+  amqp_free(pool->allocator, entries);
+
+  *offsetptr = offset;
+  return 0;
+}
+
+static int old_decode_table(amqp_bytes_t encoded,
+			    amqp_pool_t *pool,
+			    amqp_table_t *output,
+			    size_t *offsetptr)
+{
+  size_t              offset            = *offsetptr;
+  uint32_t            tablesize         = 0;
+  int                 check             = OK;
+  int                 num_entries       = 0;
+  int                 allocated_entries = 16;
+  amqp_table_entry_t *entries;
+
+  CHECK_LIMIT(encoded, offset, 4);
+  tablesize = d_32_helper(encoded, offset);
+  offset += 4;
+  CHECK_LIMIT(encoded, offset, tablesize);
+  encoded.len = offset + tablesize;
+
+  entries = amqp_malloc(pool->allocator, allocated_entries * sizeof(amqp_table_entry_t));
+  if (entries == NULL) {
+    return -ERROR_NO_MEMORY;
+  }
+
+  while (offset < encoded.len) {
+    size_t              keylen;
+    amqp_table_entry_t *entry;
+
+    keylen = d_8_helper(encoded, offset);
+    offset++;
+
+    if (check_limit(encoded, offset, keylen) < 0) {
+      amqp_free(pool->allocator, entries);
+      return -ERROR_BAD_AMQP_DATA;
+    }
+
+    if (num_entries >= allocated_entries) {
+      void *newentries;
+      allocated_entries = allocated_entries * 2;
+      newentries = amqp_realloc(pool->allocator, entries, allocated_entries * sizeof(amqp_table_entry_t));
+      if (newentries == NULL) {
+	amqp_free(pool->allocator, entries);
+	return -ERROR_NO_MEMORY;
+      }
+      entries = newentries;
+    }
+    entry = &entries[num_entries];
+
+    entry->key.len    = keylen;
+    entry->key.bytes  = buf_at(encoded, offset);
+    offset           += keylen;
+
+    check = old_decode_field_value(encoded, pool, &entry->value, &offset);
+    if (check < 0) {
+      amqp_free(pool->allocator, entries);
+      return check;
+    }
+    num_entries++;
+  }
+
+  output->num_entries = num_entries;
+  output->entries = amqp_pool_alloc(pool, num_entries * sizeof(amqp_table_entry_t));
+  if (output->entries == NULL && num_entries > 0) {
+    amqp_free(pool->allocator, entries);
+    return -ERROR_NO_MEMORY;
+  }
+
+  memcpy(output->entries, entries, num_entries * sizeof(amqp_table_entry_t));
+  amqp_free(pool->allocator, entries);
+
+  *offsetptr = offset;
+  return 0;
+}
+
+static int old_decode_field_value(amqp_bytes_t encoded,
+				  amqp_pool_t *pool,
+				  amqp_field_value_t *entry,
+				  size_t *offsetptr)
+{
+  size_t offset = *offsetptr;
+  int    check  = OK;
+
+  CHECK_LIMIT(encoded, offset, 1);
+  entry->kind = d_8_helper(encoded, offset);
+  offset++;
+
+  switch (entry->kind) {
+    case AMQP_FIELD_KIND_BOOLEAN:
+      CHECK_LIMIT(encoded, offset, 1);
+      entry->value.boolean = d_8_helper(encoded, offset) ? 1 : 0;
+      offset++;
+      break;
+    case AMQP_FIELD_KIND_I8:
+    case AMQP_FIELD_KIND_U8:
+      CHECK_LIMIT(encoded, offset, 1);
+      entry->value.u8 = d_8_helper(encoded, offset);
+      offset++;
+      break;
+    case AMQP_FIELD_KIND_I16:
+    case AMQP_FIELD_KIND_U16:
+      CHECK_LIMIT(encoded, offset, 2);
+      entry->value.u16 = d_16_helper(encoded, offset);
+      offset += 2;
+      break;
+    case AMQP_FIELD_KIND_I32:
+    case AMQP_FIELD_KIND_U32:
+    case AMQP_FIELD_KIND_F32:
+      CHECK_LIMIT(encoded, offset, 4);
+      entry->value.u32 = d_32_helper(encoded, offset);
+      offset += 4;
+      break;
+    case AMQP_FIELD_KIND_I64:
+    case AMQP_FIELD_KIND_F64:
+    case AMQP_FIELD_KIND_TIMESTAMP:
+      CHECK_LIMIT(encoded, offset, 8);
+      entry->value.u64 = d_64_helper(encoded, offset);
+      offset += 8;
+      break;
+    case AMQP_FIELD_KIND_DECIMAL:
+      CHECK_LIMIT(encoded, offset, 5);
+      entry->value.decimal.decimals = d_8_helper(encoded, offset);
+      offset++;
+      entry->value.decimal.value = d_32_helper(encoded, offset);
+      offset += 4;
+      break;
+    case AMQP_FIELD_KIND_UTF8:
+    case AMQP_FIELD_KIND_BYTES:
+      CHECK_LIMIT(encoded, offset, 4);
+      entry->value.bytes.len = d_32_helper(encoded, offset);
+      offset += 4;
+      CHECK_LIMIT(encoded, offset, entry->value.bytes.len);
+      entry->value.bytes.bytes = buf_at(encoded, offset);
+      offset += entry->value.bytes.len;
+      break;
+    case AMQP_FIELD_KIND_ARRAY:
+      check = old_decode_array(encoded, pool, &(entry->value.array), &offset);
+      break;
+    case AMQP_FIELD_KIND_TABLE:
+      check = old_decode_table(encoded, pool, &(entry->value.table), &offset);
+      break;
+    case AMQP_FIELD_KIND_VOID:
+      break;
+    default:
+      check = -ERROR_BAD_AMQP_DATA;
+      break;
+  }
+
+  if (check < 0)
+    return check;
+
+  *offsetptr = offset;
+  return OK;
+}
+
+/*---------------------------------------------------------------------------*/
+
+typedef int (*decode_fn_t)(amqp_bytes_t encoded, amqp_pool_t *pool,
+			   amqp_table_t *output, size_t *offsetptr);
+
+/*
+ * A table of num_entries headers of the kinds brokers and clients
+ * usually send: strings, integers, flags, timestamps, and a small
+ * nested table or array now and then.
+ */
+static amqp_bytes_t build_table(int num_entries, amqp_pool_t *pool)
+{
+  static amqp_table_entry_t nested_entries[3];
+  static amqp_field_value_t array_values[4];
+  amqp_table_entry_t *entries = amqp_pool_alloc(pool, num_entries * sizeof(amqp_table_entry_t));
+  amqp_table_t table;
+  amqp_bytes_t encoded;
+  size_t offset = 0;
+  int i;
+
+  nested_entries[0].key = amqp_cstring_bytes("reason");
+  nested_entries[0].value.kind = AMQP_FIELD_KIND_UTF8;
+  nested_entries[0].value.value.bytes = amqp_cstring_bytes("expired");
+  nested_entries[1].key = amqp_cstring_bytes("count");
+  nested_entries[1].value.kind = AMQP_FIELD_KIND_I64;
+  nested_entries[1].value.value.i64 = 3;
+  nested_entries[2].key = amqp_cstring_bytes("queue");
+  nested_entries[2].value.kind = AMQP_FIELD_KIND_UTF8;
+  nested_entries[2].value.value.bytes = amqp_cstring_bytes("orders.eu-west");
+  for (i = 0; i < 4; i++) {
+    array_values[i].kind = AMQP_FIELD_KIND_I32;
+    array_values[i].value.i32 = i * 1000;
+  }
+
+  for (i = 0; i < num_entries; i++) {
+    char *key = amqp_pool_alloc(pool, 24);
+    amqp_field_value_t *value = &entries[i].value;
+
+    sprintf(key, "x-header-%d", (i * 7919) % 100000);
+    entries[i].key = amqp_cstring_bytes(key);
+    switch (i % 8) {
+      case 0: case 3:
+	value->kind = AMQP_FIELD_KIND_UTF8;
+	value->value.bytes = amqp_cstring_bytes("application/json; charset=utf-8");
+	break;
+      case 1:
+	value->kind = AMQP_FIELD_KIND_I32;
+	value->value.i32 = i;
+	break;
+      case 2:
+	value->kind = AMQP_FIELD_KIND_BOOLEAN;
+	value->value.boolean = i & 1;
+	break;
+      case 4:
+	value->kind = AMQP_FIELD_KIND_TIMESTAMP;
+	value->value.u64 = 1287360000 + i;
+	break;
+      case 5:
+	value->kind = AMQP_FIELD_KIND_I64;
+	value->value.i64 = i * 1000003LL;
+	break;
+      case 6:
+	value->kind = AMQP_FIELD_KIND_TABLE;
+	value->value.table.num_entries = 3;
+	value->value.table.entries = nested_entries;
+	break;
+      default:
+	value->kind = AMQP_FIELD_KIND_ARRAY;
+	value->value.array.num_entries = 4;
+	value->value.array.entries = array_values;
+	break;
+    }
+  }
+
+  table.num_entries = num_entries;
+  table.entries = entries;
+  encoded.len = amqp_table_encoded_size(&table);
+  encoded.bytes = malloc(encoded.len);
+  if (encoded.bytes == NULL || amqp_encode_table(encoded, &table, &offset) < 0) {
+    fprintf(stderr, "cannot encode a table of %d entries\n", num_entries);
+    exit(1);
+  }
+  return encoded;
+}
+
+/* The old decoder followed by a sort, for amqp_table_get. */
+static int old_decode_sorted(amqp_bytes_t encoded,
+			     amqp_pool_t *pool,
+			     amqp_table_t *output,
+			     size_t *offsetptr)
+{
+  int res = old_decode_table(encoded, pool, output, offsetptr);
+  if (res == 0)
+    amqp_table_sort(output);
+  return res;
+}
+
+/* Nanoseconds per table decoded. */
+static double time_decode(decode_fn_t decode, int flags, amqp_bytes_t encoded, int num_entries)
+{
+  amqp_pool_t pool;
+  amqp_table_t table;
+  int iterations = TOTAL_ENTRIES / num_entries;
+  uint64_t start;
+  int i;
+
+  init_amqp_pool(&pool, 131072);
+  amqp_pool_set_flags(&pool, AMQP_POOL_NO_ZERO_FILL | flags);
+
+  start = amqp_monotonic_usec();
+  for (i = 0; i < iterations; i++) {
+    size_t offset = 0;
+
+    if (decode(encoded, &pool, &table, &offset) < 0 || table.num_entries != num_entries) {
+      fprintf(stderr, "decode failed\n");
+      exit(1);
+    }
+    recycle_amqp_pool(&pool);
+  }
+  start = amqp_monotonic_usec() - start;
+
+  empty_amqp_pool(&pool);
+  return start * 1000.0 / iterations;
+}
+
+int main(void)
+{
+  static int const sizes[] = { 5, 50, 500 };
+  amqp_pool_t pool;
+  size_t i;
+
+  init_amqp_pool(&pool, 65536);
+  printf("%8s %12s %12s %8s %12s %12s %8s\n", "entries",
+	 "old ns", "new ns", "speedup", "sorted old", "sorted new", "speedup");
+
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    amqp_bytes_t encoded = build_table(sizes[i], &pool);
+    double old_ns, new_ns, old_sorted_ns, new_sorted_ns;
+
+    time_decode(amqp_decode_table, 0, encoded, sizes[i]); /* warm up */
+    old_ns = time_decode(old_decode_table, 0, encoded, sizes[i]);
+    new_ns = time_decode(amqp_decode_table, 0, encoded, sizes[i]);
+    old_sorted_ns = time_decode(old_decode_sorted, 0, encoded, sizes[i]);
+    new_sorted_ns = time_decode(amqp_decode_table, AMQP_POOL_SORTED_TABLES, encoded, sizes[i]);
+    printf("%8d %12.1f %12.1f %7.2fx %12.1f %12.1f %7.2fx\n", sizes[i],
+	   old_ns, new_ns, old_ns / new_ns,
+	   old_sorted_ns, new_sorted_ns, old_sorted_ns / new_sorted_ns);
+    free(encoded.bytes);
+  }
+
+  empty_amqp_pool(&pool);
+  return 0;
+}
@@ -93,75 +93,86 @@ def genErl(spec):
     def genLookupMethodName(m):
         print '    case %s: return "%s";' % (m.defName(), m.defName())
 
-    def genSingleDecode(prefix, cLvalue, unresolved_domain):
+    # The codecs below are built from lists of steps. A step is a pair
+    # (width, lines): a fixed-width step has its width in bytes, and a
+    # step whose width is None carries its own bounds check. emitSteps
+    # merges each run of fixed-width steps under a single check, after
+    # which the unchecked helpers are used.
+
+    fixedWidths = {
+        'octet': 1,
+        'short': 2,
+        'long': 4,
+        'longlong': 8,
+        'timestamp': 8,
+    }
+
+    def checkLimit(width):
+        return "if (check_limit(encoded, offset, %s) < 0) return -ERROR_BAD_AMQP_DATA;" % (width,)
+
+    def emitSteps(prefix, steps):
+        run = []
+        def flush():
+            if run:
+                print prefix + checkLimit(sum([w for (w, lines) in run]))
+                for (w, lines) in run:
+                    for line in lines: print prefix + line
+            del run[:]
+        for (width, lines) in steps:
+            if width is None:
+                flush()
+                for line in lines: print prefix + line
+            else:
+                run.append((width, lines))
+        flush()
+
+    def singleDecodeSteps(cLvalue, unresolved_domain):
         type = spec.resolveDomain(unresolved_domain)
-        if type == 'shortstr':
-            print prefix + "%s.len = amqp_d8(encoded, offset);" % (cLvalue,)
-            print prefix + "offset++;"
-            print prefix + "%s.bytes = amqp_dbytes(encoded, offset, %s.len);" % (cLvalue, cLvalue)
-            print prefix + "offset += %s.len;" % (cLvalue,)
-        elif type == 'longstr':
-            print prefix + "%s.len = amqp_d32(encoded, offset);" % (cLvalue,)
-            print prefix + "offset += 4;"
-            print prefix + "%s.bytes = amqp_dbytes(encoded, offset, %s.len);" % (cLvalue, cLvalue)
-            print prefix + "offset += %s.len;" % (cLvalue,)
-        elif type == 'octet':
-            print prefix + "%s = amqp_d8(encoded, offset);" % (cLvalue,)
-            print prefix + "offset++;"
-        elif type == 'short':
-            print prefix + "%s = amqp_d16(encoded, offset);" % (cLvalue,)
-            print prefix + "offset += 2;"
-        elif type == 'long':
-            print prefix + "%s = amqp_d32(encoded, offset);" % (cLvalue,)
-            print prefix + "offset += 4;"
-        elif type == 'longlong':
-            print prefix + "%s = amqp_d64(encoded, offset);" % (cLvalue,)
-            print prefix + "offset += 8;"
-        elif type == 'timestamp':
-            print prefix + "%s = amqp_d64(encoded, offset);" % (cLvalue,)
-            print prefix + "offset += 8;"
+        if type == 'shortstr' or type == 'longstr':
+            if type == 'shortstr':
+                width, helper = 1, "d_8_helper"
+            else:
+                width, helper = 4, "d_32_helper"
+            return [(width, ["%s.len = %s(encoded, offset);" % (cLvalue, helper),
+                             "offset += %d;" % (width,)]),
+                    (None, [checkLimit("%s.len" % (cLvalue,)),
+                            "%s.bytes = buf_at(encoded, offset);" % (cLvalue,),
+                            "offset += %s.len;" % (cLvalue,)])]
+        elif type in fixedWidths:
+            width = fixedWidths[type]
+            return [(width, ["%s = d_%d_helper(encoded, offset);" % (cLvalue, width * 8),
+                             "offset += %d;" % (width,)])]
         elif type == 'bit':
             raise "Can't decode bit in genSingleDecode"
         elif type == 'table':
-            print prefix + "table_result = amqp_decode_table(encoded, pool, &(%s), &offset);" % \
-                  (cLvalue,)
-            print prefix + "if ( table_result < 0 ) return table_result;"
+            return [(None, ["table_result = amqp_decode_table(encoded, pool, &(%s), &offset);" % \
+                            (cLvalue,),
+                            "if ( table_result < 0 ) return table_result;"])]
         else:
             raise "Illegal domain in genSingleDecode", type
 
-    def genSingleEncode(prefix, cValue, unresolved_domain):
+    def singleEncodeSteps(cValue, unresolved_domain):
         type = spec.resolveDomain(unresolved_domain)
-        if type == 'shortstr':
-            print prefix + "amqp_e8(encoded, offset, %s.len);" % (cValue,)
-            print prefix + "offset++;"
-            print prefix + "amqp_ebytes(encoded, offset, %s.len, %s.bytes);" % (cValue, cValue)
-            print prefix + "offset += %s.len;" % (cValue,)
-        elif type == 'longstr':
-            print prefix + "amqp_e32(encoded, offset, %s.len);" % (cValue,)
-            print prefix + "offset += 4;"
-            print prefix + "amqp_ebytes(encoded, offset, %s.len, %s.bytes);" % (cValue, cValue)
-            print prefix + "offset += %s.len;" % (cValue,)
-        elif type == 'octet':
-            print prefix + "amqp_e8(encoded, offset, %s);" % (cValue,)
-            print prefix + "offset++;"
-        elif type == 'short':
-            print prefix + "amqp_e16(encoded, offset, %s);" % (cValue,)
-            print prefix + "offset += 2;"
-        elif type == 'long':
-            print prefix + "amqp_e32(encoded, offset, %s);" % (cValue,)
-            print prefix + "offset += 4;"
-        elif type == 'longlong':
-            print prefix + "amqp_e64(encoded, offset, %s);" % (cValue,)
-            print prefix + "offset += 8;"
-        elif type == 'timestamp':
-            print prefix + "amqp_e64(encoded, offset, %s);" % (cValue,)
-            print prefix + "offset += 8;"
+        if type == 'shortstr' or type == 'longstr':
+            if type == 'shortstr':
+                width, helper = 1, "e_8_helper"
+            else:
+                width, helper = 4, "e_32_helper"
+            return [(None, [checkLimit("%d + %s.len" % (width, cValue)),
+                            "%s(encoded, offset, %s.len);" % (helper, cValue),
+                            "offset += %d;" % (width,),
+                            "memcpy(buf_at(encoded, offset), %s.bytes, %s.len);" % (cValue, cValue),
+                            "offset += %s.len;" % (cValue,)])]
+        elif type in fixedWidths:
+            width = fixedWidths[type]
+            return [(width, ["e_%d_helper(encoded, offset, %s);" % (width * 8, cValue),
+                             "offset += %d;" % (width,)])]
         elif type == 'bit':
             raise "Can't encode bit in genSingleDecode"
         elif type == 'table':
-            print prefix + "table_result = amqp_encode_table(encoded, &(%s), &offset);" % \
-                  (cValue,)
-            print prefix + "if (table_result < 0) return table_result;"
+            return [(None, ["table_result = amqp_encode_table(encoded, &(%s), &offset);" % \
+                            (cValue,),
+                            "if (table_result < 0) return table_result;"])]
         else:
             raise "Illegal domain in genSingleEncode", type
 
@@ -173,6 +184,7 @@ def genErl(spec):
             print "      if (m == NULL) { return -ERROR_NO_MEMORY; }"
         else:
             print "      %s *m = NULL; /* no fields */" % (m.structName(),)
+        steps = []
         bitindex = None
         for f in m.arguments:
             if spec.resolveDomain(f.domain) == 'bit':
@@ -181,14 +193,15 @@ def genErl(spec):
                 if bitindex >= 8:
                     bitindex = 0
                 if bitindex == 0:
-                    print "      bit_buffer = amqp_d8(encoded, offset);"
-                    print "      offset++;"
-                print "      m->%s = (bit_buffer & (1 << %d)) ? 1 : 0;" % \
-                      (c_ize(f.name), bitindex)
+                    steps.append((1, ["bit_buffer = d_8_helper(encoded, offset);",
+                                      "offset++;"]))
+                steps.append((0, ["m->%s = (bit_buffer & (1 << %d)) ? 1 : 0;" % \
+                                  (c_ize(f.name), bitindex)]))
                 bitindex = bitindex + 1
             else:
                 bitindex = None
-                genSingleDecode("      ", "m->%s" % (c_ize(f.name),), f.domain)
+                steps.extend(singleDecodeSteps("m->%s" % (c_ize(f.name),), f.domain))
+        emitSteps("      ", steps)
         print "      *decoded = m;"
         print "      return 0;"
         print "    }"
@@ -204,7 +217,7 @@ def genErl(spec):
                 pass
             else:
                 print "      if (flags & %s) {" % (cFlagName(c, f),)
-                genSingleDecode("        ", "p->%s" % (c_ize(f.name),), f.domain)
+                emitSteps("        ", singleDecodeSteps("p->%s" % (c_ize(f.name),), f.domain))
                 print "      }"
         print "      *decoded = p;"
         print "      return 0;"
@@ -214,29 +227,31 @@ def genErl(spec):
         print "    case %s: {" % (m.defName(),)
         if m.arguments:
             print "      %s *m = (%s *) decoded;" % (m.structName(), m.structName())
+        steps = []
         bitindex = None
         def finishBits():
             if bitindex is not None:
-                print "      amqp_e8(encoded, offset, bit_buffer);"
-                print "      offset++;"
+                steps.append((1, ["e_8_helper(encoded, offset, bit_buffer);",
+                                  "offset++;"]))
         for f in m.arguments:
             if spec.resolveDomain(f.domain) == 'bit':
                 if bitindex is None:
                     bitindex = 0
-                    print "      bit_buffer = 0;"
+                    steps.append((0, ["bit_buffer = 0;"]))
                 if bitindex >= 8:
                     finishBits()
-                    print "      bit_buffer = 0;"
+                    steps.append((0, ["bit_buffer = 0;"]))
                     bitindex = 0
-                print "      if (m->%s) { bit_buffer |= (1 << %d); }" % \
-                      (c_ize(f.name), bitindex)
+                steps.append((0, ["if (m->%s) { bit_buffer |= (1 << %d); }" % \
+                                  (c_ize(f.name), bitindex)]))
                 bitindex = bitindex + 1
             else:
                 finishBits()
                 bitindex = None
-                genSingleEncode("      ", "m->%s" % (c_ize(f.name),), f.domain)
+                steps.extend(singleEncodeSteps("m->%s" % (c_ize(f.name),), f.domain))
         finishBits()
-        print "      return offset;"
+        emitSteps("      ", steps)
+        print "      return (int) offset;"
         print "    }"
 
     def genEncodeProperties(c):
@@ -248,9 +263,63 @@ def genErl(spec):
                 pass
             else:
                 print "      if (flags & %s) {" % (cFlagName(c, f),)
-                genSingleEncode("        ", "p->%s" % (c_ize(f.name),), f.domain)
+                emitSteps("        ", singleEncodeSteps("p->%s" % (c_ize(f.name),), f.domain))
                 print "      }"
-        print "      return offset;"
+        print "      return (int) offset;"
+        print "    }"
+
+    def sizeTerms(cValue, type):
+        # (fixed width, lines adding the variable part to size)
+        if type in fixedWidths:
+            return (fixedWidths[type], [])
+        elif type == 'shortstr':
+            return (1, ["size += %s.len;" % (cValue,)])
+        elif type == 'longstr':
+            return (4, ["size += %s.len;" % (cValue,)])
+        elif type == 'table':
+            return (0, ["table_size = amqp_table_encoded_size(&(%s));" % (cValue,),
+                        "if (table_size == 0) return -ERROR_BAD_AMQP_DATA;",
+                        "size += table_size;"])
+        else:
+            raise "Illegal domain in sizeTerms", type
+
+    def genSizeMethodFields(m):
+        print "    case %s: {" % (m.defName(),)
+        fixed = 0
+        lines = []
+        bitindex = None
+        for f in m.arguments:
+            type = spec.resolveDomain(f.domain)
+            if type == 'bit':
+                if bitindex is None or bitindex >= 8:
+                    fixed = fixed + 1
+                    bitindex = 0
+                bitindex = bitindex + 1
+            else:
+                bitindex = None
+                (width, more) = sizeTerms("m->%s" % (c_ize(f.name),), type)
+                fixed = fixed + width
+                lines.extend(more)
+        if lines:
+            print "      %s *m = (%s *) decoded;" % (m.structName(), m.structName())
+            for line in lines: print "      " + line
+        print "      return (int) (size + %d);" % (fixed,)
+        print "    }"
+
+    def genSizeProperties(c):
+        print "    case %d: {" % (c.index,)
+        if [f for f in c.fields if spec.resolveDomain(f.domain) != 'bit']:
+            print "      %s *p = (%s *) decoded;" % (c.structName(), c.structName())
+        for f in c.fields:
+            type = spec.resolveDomain(f.domain)
+            if type != 'bit':
+                (width, more) = sizeTerms("p->%s" % (c_ize(f.name),), type)
+                print "      if (flags & %s) {" % (cFlagName(c, f),)
+                if width:
+                    print "        size += %d;" % (width,)
+                for line in more: print "        " + line
+                print "      }"
+        print "      return (int) size;"
         print "    }"
 
     methods = spec.allMethods()
@@ -310,7 +379,7 @@ int amqp_decode_method(amqp_method_number_t methodNumber,
                        amqp_bytes_t encoded,
                        void **decoded)
 {
-  int offset = 0;
+  size_t offset = 0;
   int table_result;
   uint8_t bit_buffer;
 
@@ -326,7 +395,7 @@ int amqp_decode_properties(uint16_t class_id,
                            amqp_bytes_t encoded,
                            void **decoded)
 {
-  int offset = 0;
+  size_t offset = 0;
   int table_result;
 
   amqp_flags_t flags = 0;
@@ -334,7 +403,8 @@ int amqp_decode_properties(uint16_t class_id,
   amqp_flags_t partial_flags;
 
   do {
-    partial_flags = amqp_d16(encoded, offset);
+    if (check_limit(encoded, offset, 2) < 0) return -ERROR_BAD_AMQP_DATA;
+    partial_flags = d_16_helper(encoded, offset);
     offset += 2;
     flags |= (partial_flags << (flagword_index * 16));
     flagword_index++;
@@ -351,7 +421,7 @@ int amqp_encode_method(amqp_method_number_t methodNumber,
                        void *decoded,
                        amqp_bytes_t encoded)
 {
-  int offset = 0;
+  size_t offset = 0;
   int table_result;
   uint8_t bit_buffer;
 
@@ -366,7 +436,7 @@ int amqp_encode_properties(uint16_t class_id,
                            void *decoded,
                            amqp_bytes_t encoded)
 {
-  int offset = 0;
+  size_t offset = 0;
   int table_result;
 
   /* Cheat, and get the flags out generically, relying on the
@@ -381,7 +451,8 @@ int amqp_encode_properties(uint16_t class_id,
       amqp_flags_t remainder = remaining_flags >> 16;
       uint16_t partial_flags = remaining_flags & 0xFFFE;
       if (remainder != 0) { partial_flags |= 1; }
-      amqp_e16(encoded, offset, partial_flags);
+      if (check_limit(encoded, offset, 2) < 0) return -ERROR_BAD_AMQP_DATA;
+      e_16_helper(encoded, offset, partial_flags);
       offset += 2;
       remaining_flags = remainder;
     } while (remaining_flags != 0);
@@ -393,6 +464,41 @@ int amqp_encode_properties(uint16_t class_id,
   }
 }"""
 
+    print """
+int amqp_encoded_method_size(amqp_method_number_t methodNumber,
+                             void *decoded)
+{
+  size_t size = 0;
+  size_t table_size;
+
+  switch (methodNumber) {"""
+    for m in methods: genSizeMethodFields(m)
+    print """    default: return -ERROR_UNKNOWN_METHOD;
+  }
+}"""
+
+    print """
+int amqp_encoded_properties_size(uint16_t class_id,
+                                 void *decoded)
+{
+  size_t size = 0;
+  size_t table_size;
+
+  /* As in amqp_encode_properties: a word per 16 bits of flags. */
+  amqp_flags_t flags = * (amqp_flags_t *) decoded; /* cheating! */
+  amqp_flags_t remaining_flags = flags;
+
+  do {
+    size += 2;
+    remaining_flags >>= 16;
+  } while (remaining_flags != 0);
+
+  switch (class_id) {"""
+    for c in spec.allClasses(): genSizeProperties(c)
+    print """    default: return -ERROR_UNKNOWN_CLASS;
+  }
+}"""
+
 def genHrl(spec):
     def cType(domain):
         return cTypeMap[spec.resolveDomain(domain)]
@@ -445,6 +551,12 @@ extern int amqp_encode_method(amqp_method_number_t methodNumber,
 extern int amqp_encode_properties(uint16_t class_id,
                                   void *decoded,
                                   amqp_bytes_t encoded);
+/* Exact encoded sizes, without frame or content headers, or a
+   negative error code. */
+extern int amqp_encoded_method_size(amqp_method_number_t methodNumber,
+                                    void *decoded);
+extern int amqp_encoded_properties_size(uint16_t class_id,
+                                        void *decoded);
 """
 
     print "/* Method field records. */"
@@ -0,0 +1,204 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1/GPL 2.0
+ *
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See
+ * the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * The Original Code is librabbitmq.
+ *
+ * The Initial Developers of the Original Code are LShift Ltd, Cohesive
+ * Financial Technologies LLC, and Rabbit Technologies Ltd.  Portions
+ * created before 22-Nov-2008 00:00:00 GMT by LShift Ltd, Cohesive
+ * Financial Technologies LLC, or Rabbit Technologies Ltd are Copyright
+ * (C) 2007-2008 LShift Ltd, Cohesive Financial Technologies LLC, and
+ * Rabbit Technologies Ltd.
+ *
+ * Portions created by LShift Ltd are Copyright (C) 2007-2009 LShift
+ * Ltd. Portions created by Cohesive Financial Technologies LLC are
+ * Copyright (C) 2007-2009 Cohesive Financial Technologies
+ * LLC. Portions created by Rabbit Technologies Ltd are Copyright (C)
+ * 2007-2009 Rabbit Technologies Ltd.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (C) 2009-2010
+ * LShift Ltd and Tony Garnock-Jones.
+ *
+ * All Rights Reserved.
+ *
+ * Contributor(s): ______________________________________.
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License Version 2 or later (the "GPL"), in
+ * which case the provisions of the GPL are applicable instead of those
+ * above. If you wish to allow use of your version of this file only
+ * under the terms of the GPL, and not to allow others to use your
+ * version of this file under the terms of the MPL, indicate your
+ * decision by deleting the provisions above and replace them with the
+ * notice and other provisions required by the GPL. If you do not
+ * delete the provisions above, a recipient may use your version of
+ * this file under the terms of any one of the MPL or the GPL.
+ *
+ * ***** END LICENSE BLOCK *****
+ */
+/*
+ * Checks of field table lookups, built and run by "make check" with
+ * the library's own flags (so with NDEBUG, and amqp_assert off).
+ * Exits non-zero if any check fails.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "amqp.h"
+#include "amqp_private.h"
+
+static int failures = 0;
+
+#define CHECK(cond)							\
+  do {									\
+    if (!(cond)) {							\
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      failures++;							\
+    }									\
+  } while (0)
+
+/* { "b": 2, "a": "x", "n": { "k": 7 } }, in that order on the wire. */
+static amqp_bytes_t encode_sample(void)
+{
+  static amqp_table_entry_t nested_entries[1];
+  static amqp_table_entry_t entries[3];
+  amqp_table_t table;
+  amqp_bytes_t encoded;
+  size_t offset = 0;
+
+  nested_entries[0].key = amqp_cstring_bytes("k");
+  nested_entries[0].value.kind = AMQP_FIELD_KIND_I32;
+  nested_entries[0].value.value.i32 = 7;
+
+  entries[0].key = amqp_cstring_bytes("b");
+  entries[0].value.kind = AMQP_FIELD_KIND_I32;
+  entries[0].value.value.i32 = 2;
+  entries[1].key = amqp_cstring_bytes("a");
+  entries[1].value.kind = AMQP_FIELD_KIND_UTF8;
+  entries[1].value.value.bytes = amqp_cstring_bytes("x");
+  entries[2].key = amqp_cstring_bytes("n");
+  entries[2].value.kind = AMQP_FIELD_KIND_TABLE;
+  entries[2].value.value.table.num_entries = 1;
+  entries[2].value.value.table.entries = nested_entries;
+
+  table.num_entries = 3;
+  table.entries = entries;
+  encoded.len = amqp_table_encoded_size(&table);
+  encoded.bytes = malloc(encoded.len);
+  if (encoded.bytes == NULL || amqp_encode_table(encoded, &table, &offset) < 0) {
+    fprintf(stderr, "cannot encode the sample table\n");
+    exit(1);
+  }
+  return encoded;
+}
+
+static int key_is(amqp_table_entry_t const *entry, char const *key)
+{
+  return entry->key.len == strlen(key) && memcmp(entry->key.bytes, key, entry->key.len) == 0;
+}
+
+/* Wire order by default, sorted with AMQP_POOL_SORTED_TABLES. */
+static void test_decode_order(amqp_bytes_t encoded)
+{
+  amqp_pool_t pool;
+  amqp_table_t table;
+  amqp_bytes_t path[2];
+  size_t offset = 0;
+
+  init_amqp_pool(&pool, 4096);
+
+  CHECK(amqp_decode_table(encoded, &pool, &table, &offset) == 0);
+  CHECK(table.num_entries == 3);
+  CHECK(key_is(&table.entries[0], "b") && key_is(&table.entries[1], "a")
+	&& key_is(&table.entries[2], "n"));
+  amqp_table_sort(&table);
+  CHECK(key_is(&table.entries[0], "a") && key_is(&table.entries[1], "b"));
+  CHECK(amqp_table_get(&table, amqp_cstring_bytes("b")) != NULL
+	&& amqp_table_get(&table, amqp_cstring_bytes("b"))->value.i32 == 2);
+
+  recycle_amqp_pool(&pool);
+  amqp_pool_set_flags(&pool, AMQP_POOL_SORTED_TABLES);
+  offset = 0;
+  CHECK(amqp_decode_table(encoded, &pool, &table, &offset) == 0);
+  CHECK(key_is(&table.entries[0], "a") && key_is(&table.entries[1], "b")
+	&& key_is(&table.entries[2], "n"));
+  path[0] = amqp_cstring_bytes("n");
+  path[1] = amqp_cstring_bytes("k");
+  CHECK(amqp_table_get_path(&table, path, 2) != NULL
+	&& amqp_table_get_path(&table, path, 2)->value.i32 == 7);
+  CHECK(amqp_table_get(&table, amqp_cstring_bytes("c")) == NULL);
+
+  empty_amqp_pool(&pool);
+}
+
+/* amqp_table_get and amqp_table_get_path on lazy tables. */
+static void test_lazy_get(amqp_bytes_t encoded)
+{
+  amqp_pool_t pool;
+  amqp_table_t table;
+  amqp_table_t outer;
+  amqp_table_entry_t outer_entry;
+  amqp_field_value_t value;
+  amqp_bytes_t path[2];
+  size_t offset = 0;
+
+  init_amqp_pool(&pool, 4096);
+  amqp_pool_set_flags(&pool, AMQP_POOL_LAZY_TABLES);
+
+  CHECK(amqp_decode_table(encoded, &pool, &table, &offset) == 0);
+  CHECK(amqp_table_is_lazy(&table));
+  CHECK(amqp_table_get(&table, amqp_cstring_bytes("a")) == NULL);
+  CHECK(amqp_table_get(&table, amqp_cstring_bytes("zzz")) == NULL);
+
+  path[0] = amqp_cstring_bytes("n");
+  path[1] = amqp_cstring_bytes("k");
+  CHECK(amqp_table_get_path(&table, path, 2) == NULL);
+
+  /* A lazy table nested in a searchable one. */
+  CHECK(amqp_table_find(&table, amqp_cstring_bytes("n"), &pool, &value) == 1);
+  CHECK(value.kind == AMQP_FIELD_KIND_TABLE && amqp_table_is_lazy(&value.value.table));
+  outer_entry.key = amqp_cstring_bytes("n");
+  outer_entry.value = value;
+  outer.num_entries = 1;
+  outer.entries = &outer_entry;
+  CHECK(amqp_table_get_path(&outer, path, 1) != NULL);
+  CHECK(amqp_table_get_path(&outer, path, 2) == NULL);
+
+  /* What it takes to look keys up in them. */
+  CHECK(amqp_table_find(&table, amqp_cstring_bytes("a"), &pool, &value) == 1);
+  CHECK(value.kind == AMQP_FIELD_KIND_UTF8 && value.value.bytes.len == 1);
+  CHECK(amqp_table_materialize(&outer_entry.value.value.table, &pool) == 0);
+  CHECK(amqp_table_get_path(&outer, path, 2) != NULL
+	&& amqp_table_get_path(&outer, path, 2)->value.i32 == 7);
+
+  empty_amqp_pool(&pool);
+}
+
+int main(void)
+{
+  amqp_bytes_t encoded = encode_sample();
+
+  test_decode_order(encoded);
+  test_lazy_get(encoded);
+
+  free(encoded.bytes);
+  if (failures > 0) {
+    fprintf(stderr, "%d check(s) failed\n", failures);
+    return 1;
+  }
+  return 0;
+}
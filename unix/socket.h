@@ -55,6 +55,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/uio.h>
+#include <sys/select.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/in.h>
@@ -71,6 +73,13 @@ extern int amqp_socket_socket(int domain, int type, int proto);
 #define amqp_socket_close close
 #define amqp_socket_writev writev
 
+static inline uint64_t amqp_monotonic_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static inline int amqp_socket_error()
 {
 	return errno | ERROR_CATEGORY_OS;
@@ -83,6 +83,15 @@ static inline int amqp_socket_writev(int sock, struct iovec *iov, int nvecs)
 		return -1;
 }
 
+static inline uint64_t amqp_monotonic_usec(void)
+{
+	LARGE_INTEGER now, freq;
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&freq);
+	return (uint64_t) (now.QuadPart / freq.QuadPart) * 1000000
+		+ (uint64_t) (now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+}
+
 static inline int amqp_socket_error()
 {
 	return WSAGetLastError() | ERROR_CATEGORY_OS;